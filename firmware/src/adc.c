@@ -0,0 +1,98 @@
+/*
+ * Interrupt driven ADC0 service for the internal channels (chip temperature, VDD).
+ * Conversions accumulate 16 samples for lower noise and run in idle sleep mode.
+ * Requests are queued and started one after the other from the result ready ISR.
+ *
+ * Peripherals used: ADC0.
+ */
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "adc.h"
+#include "event.h"
+#include "insomnia.h"
+
+// Number of accumulated samples per conversion (ADC0.CTRLF SAMPNUM) and as a shift
+#define ADC_SAMPNUM ADC_SAMPNUM_ACC16_gc
+#define ADC_SAMPNUM_SHIFT 4
+
+static const uint8_t muxpos[ADC_CHANNEL_COUNT] = {
+    [ADC_CHANNEL_TEMPERATURE] = ADC_MUXPOS_TEMPSENSE_gc,
+    [ADC_CHANNEL_VDD] = ADC_MUXPOS_VDDDIV10_gc,
+};
+
+static volatile uint8_t pending_mask = 0;
+static volatile uint8_t current_channel = ADC_CHANNEL_COUNT;    // ADC_CHANNEL_COUNT = idle
+// Accumulated 12-bit results
+static volatile uint16_t results[ADC_CHANNEL_COUNT];
+
+static void adc_start_next(void) {
+    for (uint8_t i = 0; i < ADC_CHANNEL_COUNT; i++) {
+        if (pending_mask & (1 << i)) {
+            pending_mask &= ~(1 << i);
+            current_channel = i;
+
+            ADC0.CTRLA = ADC_ENABLE_bm;
+            ADC0.CTRLB = ADC_PRESC_DIV64_gc;
+            ADC0.CTRLC = ADC_REFSEL_1024MV_gc;
+            ADC0.CTRLE = 16;    // Sample duration
+            ADC0.CTRLF = ADC_SAMPNUM;
+            ADC0.MUXPOS = muxpos[i];
+            ADC0.INTCTRL = ADC_RESRDY_bm;
+            ADC0.COMMAND = ADC_MODE_SINGLE_12BIT_gc | ADC_START_IMMEDIATE_gc; // Start conversion
+            // The ADC needs the peripheral clock, so only idle sleep is possible until it's done
+            insomnia_mask |= INSOMNIA_ADC;
+            return;
+        }
+    }
+
+    current_channel = ADC_CHANNEL_COUNT;
+    ADC0.CTRLA &= ~ADC_ENABLE_bm;
+    insomnia_mask &= ~INSOMNIA_ADC;
+}
+
+void adc_request(AdcChannel channel) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        pending_mask |= 1 << channel;
+        if (current_channel == ADC_CHANNEL_COUNT) {
+            adc_start_next();
+        }
+    }
+}
+
+int16_t adc_get_temperature(void) {
+    uint16_t accumulated;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        accumulated = results[ADC_CHANNEL_TEMPERATURE];
+    }
+
+    // Apply factory calibration to the 10-bit average (rounded), as in the datasheet
+    uint16_t adc_reading = (accumulated + (1 << (ADC_SAMPNUM_SHIFT + 1))) >> (ADC_SAMPNUM_SHIFT + 2);
+    int8_t sigrow_offset = SIGROW.TEMPSENSE1;
+    uint8_t sigrow_gain = SIGROW.TEMPSENSE0;
+
+    uint32_t temp = adc_reading - sigrow_offset;
+    temp *= sigrow_gain; // Result might overflow 16 bit variable (10bit+8bit)
+    temp += 0x80; // Add 1/2 to get correct rounding on division below
+    temp >>= 8; // Divide result to get Kelvin
+    int16_t temperature_celsius = temp - 273;
+    return temperature_celsius;
+}
+
+uint16_t adc_get_vdd(void) {
+    uint16_t accumulated;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        accumulated = results[ADC_CHANNEL_VDD];
+    }
+    // VDD/10 against 1.024 V reference: mV = accumulated * 10240 / (4096 * 16)
+    return ((uint32_t)accumulated * 5 + 16) / 32;
+}
+
+ISR(ADC0_RESRDY_vect) {
+    // Reading the result clears the interrupt flag. 16 x 12 bits fit into the lower 16 bits.
+    uint8_t channel = current_channel;
+    results[channel] = ADC0.RESULT;
+    event_post(EVENT_ADC, channel);
+    adc_start_next();
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+    ADC_CHANNEL_TEMPERATURE = 0,    // Internal temperature sensor
+    ADC_CHANNEL_VDD,                // Supply voltage (VDD/10)
+    ADC_CHANNEL_COUNT
+} AdcChannel;
+
+// Request a conversion (16 accumulated samples) of the given channel. Returns immediately;
+// EVENT_ADC is posted with the channel as data once the result is available.
+void adc_request(AdcChannel channel);
+
+// Results of the last completed conversions
+int16_t adc_get_temperature(void);  // °C
+uint16_t adc_get_vdd(void);         // mV
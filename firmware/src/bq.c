@@ -1,18 +1,79 @@
 #include "bq.h"
 #include "debug.h"
+#include "rtc.h"
 #include <avr/io.h>
-#include <util/delay.h>
+#include <string.h>
 
-#define BQ_ADDR 0x6B
+// Shadow copy of the configuration registers REG00..REG18, so that changes can be collected
+// and only the registers that actually changed are written, in as few transactions as possible.
+#define BQ_SHADOW_SIZE 0x19
+
+// Registers that the charger may change on its own (IINDPM/VINDPM from input source detection,
+// EN_HIZ, EN_OTG and EN_ACDRVx on various events). Their shadow values are only trusted after
+// being refreshed by bq_begin_update().
+#define BQ_SHADOW_VOLATILE ((0x07UL << 0x05) | (0x1FUL << 0x0F))
+
+// Status and fault registers REG1B..REG21 are cached and only re-read when BQ_INT reports a change,
+// or at least every BQ_STATUS_REPOLL_TICKS as a backstop against missed interrupts
+#define BQ_STATUS_FIRST 0x1B
+#define BQ_STATUS_SIZE 7
+#define BQ_STATUS_REPOLL_TICKS 10240
+
+// Fallback in case ADC_DONE was missed (all channels at 15 bit take about 220 ms)
+#define BQ_ADC_TIMEOUT_TICKS 300
+
+// Bridge gaps of up to this many unchanged registers when flushing, as that is cheaper than
+// starting a new transaction
+#define BQ_FLUSH_MAX_GAP 2
 
 static uint8_t bq_read_register(uint8_t reg);
 static uint16_t bq_read_register16(uint8_t reg);
+static bool bq_read_registers(uint8_t reg, uint8_t *data, uint8_t len);
 static bool bq_write_register(uint8_t reg, uint8_t value);
-static bool bq_write_register16(uint8_t reg, uint16_t value);
+static bool bq_write_registers(uint8_t reg, uint8_t *data, uint8_t len);
 static bool bq_set_register_bit(uint8_t reg, uint8_t bitmask, bool set);
+static bool bq_update_register(uint8_t reg, uint8_t mask, uint8_t value);
+static bool bq_update_register16(uint8_t reg, uint16_t value);
+static bool bq_flush(void);
+static bool bq_enable_interrupts(void);
 
 static bool bq_read_error = false;
-static volatile bool bq_interrupt_pending = false;
+static bool bq_interrupt_pending = false;
+
+// Configuration to apply once the register reset has completed (cold start)
+static bool reset_pending = false;
+static uint16_t config_voltage_limit;
+static uint16_t config_current_limit;
+
+static uint8_t shadow[BQ_SHADOW_SIZE];
+static uint32_t shadow_dirty = 0;
+static bool shadow_fresh = false;       // volatile registers have been refreshed
+static uint8_t shadow_update_depth = 0; // nesting level of bq_begin_update()
+static uint8_t deferred_bits[BQ_SHADOW_SIZE]; // bits set while reset_pending, applied by bq_init_finish()
+static uint8_t dpdm_driver = 0x00;      // REG47, as last requested
+
+static uint8_t status[BQ_STATUS_SIZE];
+static bool status_valid = false;
+static bool status_changed = false;     // not yet reported by bq_process_interrupts()
+static uint32_t status_timestamp;
+
+typedef struct {
+    uint16_t channels;
+    uint16_t interval;
+    uint16_t last_start;
+    bool fresh;
+} BqAdcRequest;
+
+static BqAdcRequest adc_requests[BQ_ADC_CONSUMER_COUNT];
+static uint8_t adc_control = 0xC0;          // REG2E: ADC_EN, one-shot; resolution and averaging added
+static uint16_t adc_channels_disabled = 0;  // REG2F/REG30 (all enabled after reset)
+static bool adc_busy = false;
+static bool adc_done = false;
+static uint16_t adc_start;
+static uint8_t adc_consumers;               // consumers served by the conversion in progress
+
+static BqAdcSnapshot adc_snapshot;
+static bool adc_snapshot_valid = false;
 
 static uint8_t bq_read_register(uint8_t reg) {
     uint8_t data;
@@ -34,15 +95,29 @@ static uint16_t bq_read_register16(uint8_t reg) {
     }
 }
 
+static bool bq_read_registers(uint8_t reg, uint8_t *data, uint8_t len) {
+    // The BQ auto-increments the register address for multi-byte reads
+    if (twi_send_and_read_bytes(BQ_ADDR, reg, data, len)) {
+        return true;
+    } else {
+        bq_read_error = true;
+        return false;
+    }
+}
+
 static bool bq_write_register(uint8_t reg, uint8_t value) {
     return twi_send_bytes(BQ_ADDR, (uint8_t[]){reg, value}, 2);
 }
 
-static bool bq_write_register16(uint8_t reg, uint16_t value) {
-    return twi_send_bytes(BQ_ADDR, (uint8_t[]){reg, (value >> 8) & 0xFF, value & 0xFF}, 3);
+static bool bq_write_registers(uint8_t reg, uint8_t *data, uint8_t len) {
+    return twi_send_reg_bytes(BQ_ADDR, reg, data, len);
 }
 
 static bool bq_set_register_bit(uint8_t reg, uint8_t bitmask, bool set) {
+    if (reg < BQ_SHADOW_SIZE) {
+        return bq_update_register(reg, bitmask, set ? bitmask : 0);
+    }
+
     uint8_t value = bq_read_register(reg);
     if (set) {
         value |= bitmask;
@@ -52,102 +127,305 @@ static bool bq_set_register_bit(uint8_t reg, uint8_t bitmask, bool set) {
     return bq_write_register(reg, value);
 }
 
-bool bq_init(uint16_t charging_voltage_limit, uint16_t charging_current_limit) {
+// Update the bits in mask of a configuration register. The write is skipped if the value
+// doesn't change, and deferred until bq_end_update() if an update is in progress.
+static bool bq_update_register(uint8_t reg, uint8_t mask, uint8_t value) {
+    uint32_t bit = 1UL << reg;
+
+    if (reset_pending) {
+        // The registers are still being reset, and the shadow hasn't been loaded yet. Only
+        // record the bits; bq_init_finish() applies them on top of the loaded defaults.
+        shadow[reg] = (shadow[reg] & ~mask) | (value & mask);
+        deferred_bits[reg] |= mask;
+        return true;
+    }
+
+    if (!shadow_fresh && (BQ_SHADOW_VOLATILE & bit)) {
+        // Shadow value may be stale - read-modify-write, and always write
+        if (mask != 0xFF) {
+            shadow[reg] = bq_read_register(reg);
+        }
+        shadow_dirty |= bit;
+    }
+
+    uint8_t new_value = (shadow[reg] & ~mask) | (value & mask);
+    if (new_value != shadow[reg]) {
+        shadow[reg] = new_value;
+        shadow_dirty |= bit;
+    }
+
+    if (shadow_update_depth > 0) {
+        return true;
+    }
+    return bq_flush();
+}
+
+static bool bq_update_register16(uint8_t reg, uint16_t value) {
+    // Collect both bytes so they are written in one transaction
+    shadow_update_depth++;
+    bq_update_register(reg, 0xFF, value >> 8);
+    bq_update_register(reg + 1, 0xFF, value & 0xFF);
+    shadow_update_depth--;
+
+    if (shadow_update_depth > 0) {
+        return true;
+    }
+    return bq_flush();
+}
+
+// Write all changed configuration registers, using one multi-byte write per run of registers
+static bool bq_flush(void) {
     bool success = true;
+    if (reset_pending) {
+        return true;
+    }
 
-    // Configure BQ_INT pin
-    PORTA.PIN6CTRL = PORT_INVEN_bm | PORT_PULLUPEN_bm;
+    uint8_t reg = 0;
+    while (reg < BQ_SHADOW_SIZE) {
+        if (!(shadow_dirty & (1UL << reg))) {
+            reg++;
+            continue;
+        }
+
+        // Find the end of the run, bridging short gaps of unchanged registers as long as
+        // their shadow values can be trusted
+        uint8_t end = reg;
+        for (uint8_t r = reg + 1; r < BQ_SHADOW_SIZE && r - end <= BQ_FLUSH_MAX_GAP + 1; r++) {
+            uint32_t bit = 1UL << r;
+            if (shadow_dirty & bit) {
+                end = r;
+            } else if (!shadow_fresh && (BQ_SHADOW_VOLATILE & bit)) {
+                break;
+            }
+        }
+
+        success &= bq_write_registers(reg, &shadow[reg], end - reg + 1);
+        reg = end + 1;
+    }
+    shadow_dirty = 0;
 
-    // Configure BQ_CE pin
-    PORTA.DIRSET = PIN7_bm;
-    PORTA.OUTSET = PIN7_bm;
-    PORTA.PIN7CTRL = PORT_INVEN_bm;
+    // Self-clearing bits (REG_RST, FORCE_ICO, WD_RST, FORCE_INDET, FORCE_VINDPM_DET)
+    shadow[0x09] &= ~0x40;
+    shadow[0x0F] &= ~0x08;
+    shadow[0x10] &= ~0x08;
+    shadow[0x11] &= ~0x80;
+    shadow[0x13] &= ~0x02;
 
-    // Reset to defaults
-    success &= bq_write_register(0x09, 0x45);
-    if (!success) {
-        return false;
+    return success;
+}
+
+void bq_begin_update(void) {
+    if (shadow_update_depth++ == 0 && !reset_pending) {
+        // Refresh the registers that the charger may have changed (REG05..REG13) in one go
+        shadow_fresh = bq_read_registers(0x05, &shadow[0x05], 0x13 - 0x05 + 1);
     }
-    _delay_ms(250);
+}
 
-    // Set up registers according to our needs. The comments below only reflect deviations from the POR defaults.
+bool bq_end_update(void) {
+    if (--shadow_update_depth > 0) {
+        return true;
+    }
+    bool success = bq_flush();
+    shadow_fresh = false;
+    return success;
+}
 
-    // REG0A (set first as it will reset the registers below): Cell count
+// Bits of the configuration registers that are changed during operation, and are therefore
+// not compared when resuming after a warm reset
+static const uint8_t runtime_bits[BQ_SHADOW_SIZE] = {
+    [0x0D] = 0xFF,  // IOTG
+    [0x0F] = 0x20,  // EN_CHG
+    [0x11] = 0xC0,  // FORCE_INDET, AUTO_INDET_EN
+    [0x12] = 0x40,  // EN_OTG
+    [0x13] = 0xC0,  // EN_ACDRV1/2
+    [0x16] = 0x0C,  // EN_VBUS/VAC pulldowns
+    [0x18] = 0x01,  // TS_IGNORE
+};
+
+static uint8_t bq_cell_config(uint16_t charging_voltage_limit) {
+    // REG0A: Cell count
     uint8_t cell = 3;
     if (charging_voltage_limit >= 14000 && charging_voltage_limit <= 18800) {
         // Must set CELL = 4 for voltages above 14 V
         cell = 4;
-    } else if (charging_voltage_limit < 10000) {
-        // Not supported
-        return false;
     }
-    success &= bq_write_register(0x0A, (cell - 1) << 6 | 0x23);
+    return (cell - 1) << 6 | 0x23;
+}
 
+// Set up registers according to our needs (in the shadow copy, within an update).
+// The comments below only reflect deviations from the POR defaults.
+static void bq_apply_config(uint16_t charging_voltage_limit, uint16_t charging_current_limit) {
     // REG00: Minimal system voltage (VSYSMIN): 9 V
-    success &= bq_write_register(0x00, 0x1A);
+    bq_update_register(0x00, 0xFF, 0x1A);
 
     // REG01: Charge voltage limit (VREG)
-    success &= bq_write_register16(0x01, charging_voltage_limit / 10);
+    bq_update_register16(0x01, charging_voltage_limit / 10);
 
     // REG03: Charge current limit (ICHG)
-    success &= bq_write_register16(0x03, charging_current_limit / 10);
+    bq_update_register16(0x03, charging_current_limit / 10);
 
     // REG05: Input voltage limit (VINDPM) determined automatically from VBUS upon plugin
     
     // REG06: Input current limit (IINDPM) determined automatically via D+/D- detection
 
     // REG08: Use precharge current of 200 mA when battery is below 66.7% of VREG
-    success &= bq_write_register(0x08, 0x85);
+    bq_update_register(0x08, 0xFF, 0x85);
 
-    // REG09: Termination current (ITERM) is set to default 200 mA (above, along with defaults reset)
+    // REG09: Termination current (ITERM) is set to default 200 mA (along with defaults reset)
 
     // REG0B: OTG mode regulation voltage (VOTG) is set during operation as negotiated
 
     // REG0D: OTG current limit (IOTG): 3 A
-    success &= bq_write_register(0x0D, 0x4B);
+    bq_update_register(0x0D, 0xFF, 0x4B);
 
     // REG0E: Timers are left at default values
 
     // REG0F: Enable ICO, start with charging disabled
-    success &= bq_write_register(0x0F, 0x92);
+    bq_update_register(0x0F, 0xFF, 0x92);
 
     // REG10: Disable watchdog timer
-    success &= bq_write_register(0x10, 0x00);
+    bq_update_register(0x10, 0xFF, 0x00);
 
-    // REG11: Enable automatic D+/D- detection (we will override IINDPM later if PD is used)
-    success &= bq_write_register(0x11, 0x00);
-
-    // REG11: Enable HVDCP, 9 and 12 V support
-    success &= bq_write_register(0x11, 0xF8);
+    // REG11: Enable automatic D+/D- detection (we will override IINDPM later if PD is used),
+    // enable HVDCP, 9 and 12 V support
+    bq_update_register(0x11, 0xFF, 0xF8);
 
     // REG12: Disable BATFED LDO in pre-charge stage, as our load is not connected to SYS
     // See also: https://e2e.ti.com/support/power-management-group/power-management/f/power-management-forum/1443121/bq25792-expected-behavior-when-large-load-on-battery-causes-vbat-to-drop-during-charging
     // Also disable PFM
-    success &= bq_write_register(0x12, 0x34);
+    bq_update_register(0x12, 0xFF, 0x34);
 
     // REG13: 1.5 MHz switching frequency, disable STAT pin (not used)
-    success &= bq_write_register(0x13, 0x11);
+    bq_update_register(0x13, 0xFF, 0x11);
 
     // REG14: Disable external ILIM_HIZ setting
-    success &= bq_write_register(0x14, 0x14);
+    bq_update_register(0x14, 0xFF, 0x14);
 
     // REG16: Temperature control thresholds and VBUS/VAC pulldowns: defaults
 
     // REG17: NTC JEITA temperature dependent charge voltage/current settings: defaults
 
     // REG18: NTC temperature thresholds: defaults
+}
 
-    // REG28: Charger Mask 0: enable AC1/AC2_PRESENT interrupt
-    success &= bq_write_register(0x28, 0xF9);
+// After a warm reset, the BQ may still be configured by us (and charging or in OTG mode).
+// Check whether its registers match our configuration, apart from the bits that are changed
+// during operation, and take them over as they are if so.
+static bool bq_resume(uint16_t charging_voltage_limit, uint16_t charging_current_limit) {
+    uint8_t current[BQ_SHADOW_SIZE];
+    if (!bq_read_registers(0x00, current, BQ_SHADOW_SIZE)) {
+        return false;
+    }
+    if (current[0x0A] != bq_cell_config(charging_voltage_limit)) {
+        return false;
+    }
 
-    // REG29: Charger Mask 1: enable CHG interrupt
-    success &= bq_write_register(0x29, 0x7F);
+    memcpy(shadow, current, BQ_SHADOW_SIZE);
+    shadow_dirty = 0;
+    shadow_fresh = true;
+    shadow_update_depth = 1;
+    bq_apply_config(charging_voltage_limit, charging_current_limit);
+    bool match = true;
+    for (uint8_t reg = 0; reg < BQ_SHADOW_SIZE; reg++) {
+        if ((shadow_dirty & (1UL << reg)) && ((shadow[reg] ^ current[reg]) & ~runtime_bits[reg])) {
+            debug_printf("BQ REG%02x differs: %02x, expected %02x\n", reg, current[reg], shadow[reg]);
+            match = false;
+        }
+    }
+
+    // Discard the changes; either keep the registers as they are, or start over
+    memcpy(shadow, current, BQ_SHADOW_SIZE);
+    shadow_dirty = 0;
+    shadow_update_depth = 0;
+    if (!match) {
+        return false;
+    }
+
+    // The ADC channel selection may have been changed from the reset default
+    uint8_t disabled[2];
+    if (!bq_read_registers(0x2F, disabled, 2)) {
+        return false;
+    }
+    adc_channels_disabled = disabled[0] | (disabled[1] << 8);
+    return true;
+}
 
-    // REG2A: Charger Mask 2: disable all interrupts
-    success &= bq_write_register(0x2A, 0x7F);
+bool bq_init(uint16_t charging_voltage_limit, uint16_t charging_current_limit, bool warm) {
+    // Configure BQ_INT pin
+    PORTA.PIN6CTRL = PORT_INVEN_bm | PORT_PULLUPEN_bm;
+
+    // Configure BQ_CE pin
+    PORTA.DIRSET = PIN7_bm;
+    PORTA.OUTSET = PIN7_bm;
+    PORTA.PIN7CTRL = PORT_INVEN_bm;
+
+    if (charging_voltage_limit < 10000) {
+        // Not supported
+        return false;
+    }
+    config_voltage_limit = charging_voltage_limit;
+    config_current_limit = charging_current_limit;
+
+    if (warm && bq_resume(charging_voltage_limit, charging_current_limit)) {
+        debug_printf("BQ configuration kept\n");
+        return bq_enable_interrupts();
+    }
+
+    // Reset to defaults. The configuration is written by bq_init_finish() after BQ_RESET_TICKS,
+    // so that the main loop (and with it USB PD) can run in the meantime.
+    if (!bq_write_register(0x09, 0x45)) {
+        return false;
+    }
+    reset_pending = true;
+    return true;
+}
 
+bool bq_init_pending(void) {
+    return reset_pending;
+}
+
+bool bq_init_finish(void) {
+    bool success = true;
+    uint8_t deferred[BQ_SHADOW_SIZE];
+    memcpy(deferred, shadow, BQ_SHADOW_SIZE);
+    reset_pending = false;
+
+    // REG0A (set first as it will reset the registers below)
+    success &= bq_write_register(0x0A, bq_cell_config(config_voltage_limit));
+
+    // Load the shadow copy with the resulting defaults; the changes are collected
+    // and written in a few multi-byte transactions at the end
+    success &= bq_read_registers(0x00, shadow, BQ_SHADOW_SIZE);
+    if (!success) {
+        return false;
+    }
+    shadow_dirty = 0;
+    shadow_fresh = true;
+    shadow_update_depth = 1;
+    bq_apply_config(config_voltage_limit, config_current_limit);
+
+    // Settings made in the meantime (e.g. by USB PD) take precedence over the configuration
+    for (uint8_t reg = 0; reg < BQ_SHADOW_SIZE; reg++) {
+        if (deferred_bits[reg]) {
+            bq_update_register(reg, deferred_bits[reg], deferred[reg]);
+            deferred_bits[reg] = 0;
+        }
+    }
+    success &= bq_end_update();
+    if (dpdm_driver != 0x00) {
+        success &= bq_write_register(0x47, dpdm_driver);
+    }
+    adc_channels_disabled = 0;
+
+    return success && bq_enable_interrupts();
+}
+
+static bool bq_enable_interrupts(void) {
+    // REG28: Charger Mask 0: enable AC1/AC2_PRESENT interrupt
+    // REG29: Charger Mask 1: enable CHG interrupt
+    // REG2A: Charger Mask 2: enable ADC_DONE interrupt
     // REG2B: Charger Mask 3: enable temperature interrupts
-    success &= bq_write_register(0x2B, 0x10);
+    bool success = bq_write_registers(0x28, (uint8_t[]){0xF9, 0x7F, 0x5F, 0x10}, 4);
 
     // REG2C: Fault Mask 0: defaults (all interrupts on)
 
@@ -168,29 +446,66 @@ bool bq_test_connection(void) {
 }
 
 void bq_notify_interrupt(void) {
-    // We can't perform an I2C write here, as we're being called from an ISR.
-    // If we did, we might interfere with another ongoing I2C transaction.
+    // Called from the main loop for EVENT_BQ_INT; the flags are read in bq_process_interrupts()
     bq_interrupt_pending = true;
 }
 
-bool bq_process_interrupts(void) {
-    if (!bq_interrupt_pending) {
-        return false;
+// Any change is recorded in status_changed, whoever triggered the refresh
+static void bq_refresh_status(void) {
+    uint8_t new_status[BQ_STATUS_SIZE];
+    if (!bq_read_registers(BQ_STATUS_FIRST, new_status, BQ_STATUS_SIZE)) {
+        return;
     }
-    bq_interrupt_pending = false;
-    
-    uint8_t charger_flag_0 = bq_read_register(0x22);
-    if (charger_flag_0 & 0x06) {
-        // AC1/AC2_PRESENT changed
-        return true;
+    if (!status_valid || memcmp(status, new_status, BQ_STATUS_SIZE) != 0) {
+        status_changed = true;
     }
-    uint8_t charger_flag_3 = bq_read_register(0x25);
-    if (charger_flag_3 & 0x0F) {
-        // TS temperature crossed
-        return true;
+    memcpy(status, new_status, BQ_STATUS_SIZE);
+    status_valid = true;
+    status_timestamp = rtc_get_ticks32();
+}
+
+// Cached copy of a status/fault register
+static uint8_t bq_status(uint8_t reg) {
+    if (!status_valid) {
+        bq_refresh_status();
+    }
+    return status[reg - BQ_STATUS_FIRST];
+}
+
+bool bq_process_interrupts(void) {
+    bool refresh = !status_valid || rtc_get_ticks32() - status_timestamp >= BQ_STATUS_REPOLL_TICKS;
+
+    if (bq_interrupt_pending) {
+        bq_interrupt_pending = false;
+
+        // REG22..REG27: charger and fault flags (cleared by reading). All of them are read,
+        // as the masks only determine which events assert BQ_INT; any flag other than
+        // ADC_DONE that is set means that the status may have changed.
+        uint8_t flags[6];
+        if (bq_read_registers(0x22, flags, sizeof(flags))) {
+            if (flags[2] & 0x20) {
+                // ADC_DONE
+                adc_done = true;
+                flags[2] &= ~0x20;
+            }
+            for (uint8_t i = 0; i < sizeof(flags); i++) {
+                if (flags[i]) {
+                    refresh = true;
+                }
+            }
+        } else {
+            refresh = true;
+        }
     }
 
-    return false;
+    if (refresh) {
+        bq_refresh_status();
+    }
+
+    // Also report changes picked up by a refresh from bq_status() in the meantime
+    bool changed = status_changed;
+    status_changed = false;
+    return changed;
 }
 
 bool bq_disable_charging(void) {
@@ -209,6 +524,16 @@ bool bq_disable_bc12_detection(void) {
     return bq_set_register_bit(0x11, 0x40, false);
 }
 
+// REG47 is not in the shadow copy. While the registers are being reset, the value is only
+// recorded, and written by bq_init_finish().
+static bool bq_set_dpdm_driver(uint8_t value) {
+    dpdm_driver = value;
+    if (reset_pending) {
+        return true;
+    }
+    return bq_write_register(0x47, value);
+}
+
 bool bq_enable_otg(uint16_t votg) {
     bool success = true;
 
@@ -217,10 +542,10 @@ bool bq_enable_otg(uint16_t votg) {
     }
 
     // Set output voltage (VOTG)
-    success &= bq_write_register16(0x0B, (votg - 2800) / 10);
+    success &= bq_update_register16(0x0B, (votg - 2800) / 10);
 
     // USB DCP: short-circuit D+ and D- (1.5 A)
-    success &= bq_write_register(0x47, 0xE0);
+    success &= bq_set_dpdm_driver(0xE0);
 
     // Set EN_OTG
     success &= bq_set_register_bit(0x12, 0x40, true);
@@ -241,31 +566,20 @@ bool bq_disable_otg(void) {
     success &= bq_set_register_bit(0x12, 0x40, false);
 
     // Reset D+/D- drivers
-    success &= bq_write_register(0x47, 0x00);
+    success &= bq_set_dpdm_driver(0x00);
 
     return success;
 }
 
 bool bq_set_acdrv(bool enable_acdrv1, bool enable_acdrv2) {
-    uint8_t reg = bq_read_register(0x13);
-    if (enable_acdrv1) {
-        reg |= 0x40;
-    } else {
-        reg &= ~0x40;
-    }
-    if (enable_acdrv2) {
-        reg |= 0x80;
-    } else {
-        reg &= ~0x80;
-    }
-    return bq_write_register(0x13, reg);
+    return bq_update_register(0x13, 0xC0, (enable_acdrv1 ? 0x40 : 0) | (enable_acdrv2 ? 0x80 : 0));
 }
 
 bool bq_set_otg_current_limit(uint16_t ma) {
     if (ma < 120 || ma > 3320) {
         return false;
     }
-    return bq_write_register(0x0D, ma / 40);
+    return bq_update_register(0x0D, 0xFF, ma / 40);
 }
 
 bool bq_set_input_current_limit(uint16_t ma) {
@@ -273,7 +587,7 @@ bool bq_set_input_current_limit(uint16_t ma) {
     if (ma < 100 || ma > 3300) {
         return false;
     }
-    return bq_write_register16(0x06, ma / 10);
+    return bq_update_register16(0x06, ma / 10);
 }
 
 bool bq_set_vbus_discharge(bool discharge) {
@@ -294,34 +608,35 @@ uint16_t bq_get_input_current_limit(void) {
 }
 
 uint16_t bq_get_otg_current_limit(void) {
-    return bq_read_register(0x0D) * 40;
+    // Not changed by the charger on its own
+    return shadow[0x0D] * 40;
 }
 
 ChargeStatus bq_get_charge_status(void) {
-    uint8_t chg_status_1 = bq_read_register(0x1C);
+    uint8_t chg_status_1 = bq_status(0x1C);
     return (chg_status_1 >> 5) & 0x07;
 }
 
 VbusStatus bq_get_vbus_status(void) {
-    uint8_t chg_status_1 = bq_read_register(0x1C);
+    uint8_t chg_status_1 = bq_status(0x1C);
     return (chg_status_1 >> 1) & 0x0F;
 }
 
 bool bq_get_vbat_present(void) {
-    uint8_t chg_status_2 = bq_read_register(0x1D);
+    uint8_t chg_status_2 = bq_status(0x1D);
     return chg_status_2 & 0x01;
 }
 
 bool bq_get_vbus_present(void) {
-    return bq_read_register(0x1B) & 0x01;
+    return bq_status(0x1B) & 0x01;
 }
 
 bool bq_get_ac1_present(void) {
-    return bq_read_register(0x1B) & 0x02;
+    return bq_status(0x1B) & 0x02;
 }
 
 bool bq_get_ac2_present(void) {
-    return bq_read_register(0x1B) & 0x04;
+    return bq_status(0x1B) & 0x04;
 }
 
 bool bq_get_acdrv1_status(void) {
@@ -332,61 +647,124 @@ bool bq_get_acdrv2_status(void) {
     return bq_read_register(0x13) & 0x80;
 }
 
-bool bq_enable_adc(void) {
-    // Enable ADC, continuous mode, 15 bit resolution
-    // (uses around 1 mA)
-    return bq_set_register_bit(0x2E, 0x80, true);
+void bq_adc_configure(BqAdcResolution resolution, bool averaging) {
+    // ADC_SAMPLE in bits 5:4, ADC_AVG in bit 3 (ADC_AVG_INIT = 0: continue existing average)
+    adc_control = 0xC0 | (resolution << 4) | (averaging ? 0x08 : 0);
 }
 
-bool bq_disable_adc(void) {
-    return bq_set_register_bit(0x2E, 0x80, false);
+void bq_adc_request(BqAdcConsumer consumer, uint16_t channels, uint16_t interval) {
+    BqAdcRequest *request = &adc_requests[consumer];
+    request->channels = channels;
+    request->interval = interval;
+    request->last_start = rtc_get_ticks() - interval;
+    request->fresh = false;
 }
 
-uint16_t bq_measure_vbus(void) {
-    return bq_read_register16(0x35);
+bool bq_adc_poll(BqAdcConsumer consumer) {
+    bool fresh = adc_requests[consumer].fresh;
+    adc_requests[consumer].fresh = false;
+    return fresh;
 }
 
-uint16_t bq_measure_vac1(void) {
-    return bq_read_register16(0x37);
-}
-
-uint16_t bq_measure_vac2(void) {
-    return bq_read_register16(0x39);
-}
-
-int16_t bq_measure_ibus(void) {
-    return (int16_t)bq_read_register16(0x31);
-}
+static bool bq_adc_start(uint16_t channels) {
+    // Only convert the requested channels. The ADC (around 1 mA) turns itself off after a
+    // one-shot conversion.
+    uint16_t disabled = ~channels & BQ_ADC_DISABLE_MASK;
+    if (disabled != adc_channels_disabled) {
+        if (!bq_write_registers(0x2F, (uint8_t[]){disabled & 0xFF, disabled >> 8}, 2)) {
+            return false;
+        }
+        adc_channels_disabled = disabled;
+    }
+    return bq_write_register(0x2E, adc_control);
+}
+
+uint16_t bq_adc_run(void) {
+    uint16_t now = rtc_get_ticks();
+
+    if (adc_busy) {
+        uint16_t elapsed = now - adc_start;
+        if (!adc_done && elapsed >= BQ_ADC_TIMEOUT_TICKS) {
+            // ADC_EN is cleared when a one-shot conversion has completed
+            adc_done = !(bq_read_register(0x2E) & 0x80);
+            if (!adc_done) {
+                adc_start = now;
+                elapsed = 0;
+            }
+        }
+        if (!adc_done) {
+            return BQ_ADC_TIMEOUT_TICKS - elapsed;
+        }
+
+        adc_busy = false;
+        adc_snapshot_valid = false;
+        for (uint8_t i = 0; i < BQ_ADC_CONSUMER_COUNT; i++) {
+            if (adc_consumers & (1 << i)) {
+                adc_requests[i].fresh = true;
+            }
+        }
+    }
+    adc_done = false;
+
+    // Collect the channels of all requests that are due
+    uint16_t channels = 0;
+    uint16_t timeout = 0;
+    adc_consumers = 0;
+    for (uint8_t i = 0; i < BQ_ADC_CONSUMER_COUNT; i++) {
+        BqAdcRequest *request = &adc_requests[i];
+        if (request->channels == 0) {
+            continue;
+        }
+        uint16_t elapsed = now - request->last_start;
+        if (elapsed >= request->interval) {
+            channels |= request->channels;
+            adc_consumers |= 1 << i;
+            request->last_start = now;
+            elapsed = 0;
+        }
+        uint16_t remaining = request->interval - elapsed;
+        if (timeout == 0 || remaining < timeout) {
+            timeout = remaining;
+        }
+    }
 
-uint16_t bq_measure_vbat(void) {
-    return bq_read_register16(0x3B);
-}
+    // If the conversion could not be started, the requests are served on their next interval
+    if (channels && bq_adc_start(channels)) {
+        adc_busy = true;
+        adc_start = now;
+        if (timeout == 0 || BQ_ADC_TIMEOUT_TICKS < timeout) {
+            timeout = BQ_ADC_TIMEOUT_TICKS;
+        }
+    }
 
-int16_t bq_measure_ibat(void) {
-    return (int16_t)bq_read_register16(0x33);
+    return timeout;
+}
+
+const BqAdcSnapshot *bq_read_adc_snapshot(void) {
+    if (!adc_snapshot_valid) {
+        // REG31..REG42: nine 16-bit big-endian values, laid out like the struct after the timestamp
+        uint16_t *values = (uint16_t *)&adc_snapshot.ibus;
+        const uint8_t count = (sizeof(adc_snapshot) - sizeof(adc_snapshot.timestamp)) / sizeof(uint16_t);
+        if (bq_read_registers(0x31, (uint8_t *)values, count * sizeof(uint16_t))) {
+            for (uint8_t i = 0; i < count; i++) {
+                values[i] = (values[i] << 8) | (values[i] >> 8);
+            }
+            adc_snapshot.timestamp = rtc_get_ticks32();
+            adc_snapshot_valid = true;
+        }
+    }
+    return &adc_snapshot;
 }
 
 uint16_t bq_get_fault_status(void) {
     // Ignore the following faults, as they can be transient and don't really affect the charger's operation:
     // - IBAT_REG_STAT
     // - OTG_OVP_STAT
-    uint8_t fault_status_0 = bq_read_register(0x20) & ~0x80;
-    uint8_t fault_status_1 = bq_read_register(0x21) & ~0x20;
+    uint8_t fault_status_0 = bq_status(0x20) & ~0x80;
+    uint8_t fault_status_1 = bq_status(0x21) & ~0x20;
     return (fault_status_0 << 8) | fault_status_1;
 }
 
 TemperatureStatus bq_get_temperature_status(void) {
-    return bq_read_register(0x1F) & 0x0F;
-}
-
-int16_t bq_measure_temperature(void) {
-    // Measure chip die temperature (TDIE)
-    // Temperature is in steps of 0.5 degrees Celsius
-    return bq_read_register16(0x41);
-}
-
-uint16_t bq_measure_thermistor(void) {
-    // Measure thermistor, returns relative reading (0..1023 corresponding to 0..100%)
-    uint16_t thermistor_reading = bq_read_register16(0x3F);
-    return thermistor_reading;
+    return bq_status(0x1F) & 0x0F;
 }
@@ -5,6 +5,8 @@
 
 #include "twi.h"
 
+#define BQ_ADDR 0x6B
+
 typedef enum {
     NOT_CHARGING = 0x0,
     TRICKLE_CHARGE = 0x1,
@@ -36,9 +38,72 @@ typedef enum {
     TEMP_COLD = 0x8
 } TemperatureStatus;
 
-bool bq_init(uint16_t charging_voltage_limit, uint16_t charging_current_limit);
+// ADC channels; bit positions match the ADC function disable registers REG2F (low byte) and REG30 (high byte)
+#define BQ_ADC_IBUS 0x0080
+#define BQ_ADC_IBAT 0x0040
+#define BQ_ADC_VBUS 0x0020
+#define BQ_ADC_VBAT 0x0010
+#define BQ_ADC_VSYS 0x0008
+#define BQ_ADC_TS 0x0004
+#define BQ_ADC_TDIE 0x0002
+#define BQ_ADC_VAC2 0x2000
+#define BQ_ADC_VAC1 0x1000
+#define BQ_ADC_DM 0x4000
+#define BQ_ADC_DP 0x8000
+// All channels that we make use of (D+/D- are never requested)
+#define BQ_ADC_ALL 0x30FE
+// All channel disable bits
+#define BQ_ADC_DISABLE_MASK 0xF0FE
+
+typedef enum {
+    BQ_ADC_15BIT = 0,
+    BQ_ADC_14BIT = 1,
+    BQ_ADC_13BIT = 2,
+    BQ_ADC_12BIT = 3
+} BqAdcResolution;
+
+typedef enum {
+    BQ_ADC_CONSUMER_CHARGER = 0,
+    BQ_ADC_CONSUMER_DEBUG,
+    BQ_ADC_CONSUMER_COUNT
+} BqAdcConsumer;
+
+// ADC measurement block (REG31..REG42), in register order
+typedef struct {
+    uint32_t timestamp;     // RTC ticks (rtc_get_ticks32()) when the block was read
+    int16_t ibus;           // mA
+    int16_t ibat;           // mA
+    uint16_t vbus;          // mV
+    uint16_t vac1;          // mV
+    uint16_t vac2;          // mV
+    uint16_t vbat;          // mV
+    uint16_t vsys;          // mV
+    uint16_t ts;            // thermistor, relative reading (0..1023 corresponding to 0..100%)
+    int16_t tdie;           // die temperature in steps of 0.5 degrees Celsius
+} BqAdcSnapshot;
+
+// Time for the register reset on a cold start to complete (250 ms)
+#define BQ_RESET_TICKS 256
+
+// Set up the BQ. After a warm reset (MCU reset while the BQ kept running), its configuration
+// is kept if it matches ours, so that an ongoing charging or OTG session is not interrupted.
+// Otherwise, its registers are reset, and bq_init_pending() returns true until bq_init_finish()
+// has been called (no earlier than BQ_RESET_TICKS later) to write our configuration.
+bool bq_init(uint16_t charging_voltage_limit, uint16_t charging_current_limit, bool warm);
+bool bq_init_pending(void);
+bool bq_init_finish(void);
 bool bq_test_connection(void);
+
+// Collect configuration changes and write them in as few transactions as possible on
+// bq_end_update(). Calls may be nested; only the outermost bq_end_update() writes.
+void bq_begin_update(void);
+bool bq_end_update(void);
+
+// Called from the main loop when BQ_INT has asserted (EVENT_BQ_INT)
 void bq_notify_interrupt(void);
+// Handle a pending BQ_INT and refresh the cached status/fault registers if needed.
+// Returns true if the status has changed since the last call, including through a refresh
+// triggered by a getter. The status getters below only read the cache.
 bool bq_process_interrupts(void);
 bool bq_enable_charging(void);
 bool bq_disable_charging(void);
@@ -64,15 +129,22 @@ bool bq_get_ac2_present(void);
 bool bq_get_acdrv1_status(void);
 bool bq_get_acdrv2_status(void);
 
-bool bq_enable_adc(void);
-bool bq_disable_adc(void);
-uint16_t bq_measure_vbus(void);
-uint16_t bq_measure_vac1(void);
-uint16_t bq_measure_vac2(void);
-int16_t bq_measure_ibus(void);
-uint16_t bq_measure_vbat(void);
-int16_t bq_measure_ibat(void);
+// The ADC is only run in one-shot mode, converting the union of the channels requested by
+// the consumers that are due, at the configured resolution (24 ms per channel at 15 bit,
+// halved for each bit less). With averaging, each conversion updates a running average.
+void bq_adc_configure(BqAdcResolution resolution, bool averaging);
+// Request conversions of the given channels every interval ticks (first one right away).
+// channels = 0 cancels the request.
+void bq_adc_request(BqAdcConsumer consumer, uint16_t channels, uint16_t interval);
+// Returns true (once) when a conversion including the consumer's channels has completed
+bool bq_adc_poll(BqAdcConsumer consumer);
+// Start due conversions and process completed ones. Returns a timeout in ticks until the next
+// required wakeup, or 0 if there is nothing to do.
+uint16_t bq_adc_run(void);
+
+// Read all ADC measurements in one transaction. The snapshot is only read from the bus again
+// after a new conversion has completed, so all callers share the same (coherent) set of readings.
+// Channels that were not part of the last conversion hold older values.
+const BqAdcSnapshot *bq_read_adc_snapshot(void);
 uint16_t bq_get_fault_status(void);
 TemperatureStatus bq_get_temperature_status(void);
-int16_t bq_measure_temperature(void);
-uint16_t bq_measure_thermistor(void);
@@ -6,6 +6,7 @@
 #include "led.h"
 #include "rtc.h"
 #include "sysconfig.h"
+#include "event.h"
 
 static volatile uint16_t last_button_start_ticks = 0;
 static volatile bool button_pressed = false;
@@ -14,8 +15,8 @@ static volatile bool in_config_menu = false;
 static volatile bool in_config_menu_item = false;
 static volatile uint8_t config_menu_index = 0;
 static volatile uint8_t config_item_index = 0;
-static volatile bool config_short_press_pending = false;
-static volatile bool config_medium_press_pending = false;
+static bool config_short_press_pending = false;
+static bool config_medium_press_pending = false;
 
 static ButtonHandler short_press_handler = 0;
 
@@ -150,6 +151,18 @@ bool button_handle_config_menu(void) {
     return in_config_menu;
 }
 
+void button_handle_press(uint8_t press) {
+    if (press == BUTTON_SHORT_PRESS) {
+        if (in_config_menu) {
+            config_short_press_pending = true;
+        } else if (short_press_handler) {
+            short_press_handler();
+        }
+    } else {
+        config_medium_press_pending = true;
+    }
+}
+
 void button_handle_interrupt(void) {
     // Note: this function is called from an ISR context
     // Button toggled
@@ -163,15 +176,9 @@ void button_handle_interrupt(void) {
         button_pressed = false;
         
         if (button_press_duration > 50 && button_press_duration < 1000) {
-            // Short press
-            if (in_config_menu) {
-                config_short_press_pending = true;
-            } else if (short_press_handler) {
-                short_press_handler();
-            }
+            event_post(EVENT_BUTTON, BUTTON_SHORT_PRESS);
         } else if (button_press_duration < 3000) {
-            // Medium press
-            config_medium_press_pending = true;
+            event_post(EVENT_BUTTON, BUTTON_MEDIUM_PRESS);
         } else {
             // Long press
             // Reset system
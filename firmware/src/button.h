@@ -6,8 +6,15 @@
 
 typedef void (*ButtonHandler)(void);
 
+typedef enum {
+    BUTTON_SHORT_PRESS = 1,
+    BUTTON_MEDIUM_PRESS
+} ButtonPress;
+
 void button_init(void);
 void button_handle_interrupt(void);
+// Called from the main loop for EVENT_BUTTON
+void button_handle_press(uint8_t press);
 uint16_t button_get_last_press_duration(void);
 void button_set_short_press_handler(ButtonHandler handler);
 
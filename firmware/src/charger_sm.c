@@ -8,71 +8,188 @@
 #include "debug.h"
 #include "rtc.h"
 #include "fsc_pd/timer.h"
-#include <avr/io.h>
+
+// Interval of one-shot BQ ADC conversions while (dis)charging; the LED breathing speed
+// follows the battery current, and the battery voltage is monitored in OTG mode
+#define ADC_INTERVAL_TICKS 1024
+
+// Events that trigger evaluation of the transition table
+#define EV_BQ       (1 << 0)    // BQ status/fault registers changed
+#define EV_PD       (1 << 1)    // PD connection state, contract or advertised current changed
+#define EV_KX2      (1 << 2)    // KX2 powered on or off
+#define EV_PPS      (1 << 3)    // PD policy engine requested or ended OTG mode
+#define EV_TIMER    (1 << 4)    // state timer expired
+#define EV_ADC      (1 << 5)    // new BQ ADC measurements available
+
+// Events whose conditions are evaluated again after entering a new state (the others are edges)
+#define EV_LEVEL    (EV_BQ | EV_PD | EV_KX2 | EV_PPS)
+
+// Pseudo states for the transition table
+#define CHARGER_ANY         0xFF    // any state except CHARGER_FAULT (which is only left via its own rows)
+#define CHARGER_PRE_FAULT   0xFE    // the state that was active before the fault
+
+typedef struct {
+    uint8_t from;
+    uint8_t events;         // the row is only evaluated if one of these events is pending
+    bool (*guard)(void);    // NULL = always
+    uint8_t to;
+} Transition;
 
 static ChargerState current_state;
 static ChargerState pre_fault_state;
 static uint16_t otg_voltage;
 static uint16_t otg_current;
+static bool otg_enabled = false;
+static bool initialized = false;
 static struct TimerObj state_timer;
 static bool discharging_low_battery = false;
-
+static uint8_t pending_events = 0;
+
+// Charging session statistics
+static bool charge_session = false;
+static bool charge_full = false;
+static uint32_t charge_start;
+static uint32_t time_to_full = 0;
+
+// Last seen PD state, to detect changes that are not reported by PD observer events
+static ConnectionState pd_conn_state;
+static bool pd_has_contract;
+static uint16_t pd_advertised_current;
+
+static void post_events(uint8_t events);
+static uint8_t poll_events(void);
+static ChargerState find_transition(uint8_t events);
+static void handle_events(uint8_t events);
 static void update_led_for_state(void);
-static void check_fault_conditions(void);
 static void set_state(ChargerState new_state);
-static bool check_rig_inhibit(void);
 static void update_charging_led(void);
+static void apply_otg_voltage(void);
+static void update_charge_session(void);
+
+/* Transition guards */
+static bool is_fault(void);
+static bool is_no_fault(void);
+static bool is_no_input(void);
+static bool is_no_usb_input(void);
+static bool is_dc_present(void);
+static bool is_usb_sink(void);
+static bool is_not_sink(void);
+static bool is_not_source(void);
+static bool has_contract(void);
+static bool has_no_contract(void);
+static bool is_rig_inhibit(void);
+static bool is_rig_off(void);
+static bool is_otg_blocked(void);
+static bool is_otg_enabled(void);
+static bool is_otg_disabled(void);
+static bool is_battery_low(void);
 
 /* State-specific functions (grouped by state) */
 static void enter_disconnected(void);
 static void exit_disconnected(void);
-static uint16_t handle_disconnected(void);
 
 static void enter_dc_charging(void);
-static uint16_t handle_dc_charging(void);
 
 static void enter_usb_negotiating(void);
-static uint16_t handle_usb_negotiating(void);
 
 static void enter_usb_type_c_charging(void);
-static uint16_t handle_usb_type_c_charging(void);
+static void handle_usb_type_c_charging(uint8_t events);
 
 static void enter_usb_pd_charging(void);
-static uint16_t handle_usb_pd_charging(void);
+static void handle_usb_pd_charging(uint8_t events);
 
 static void enter_rig_on(void);
-static uint16_t handle_rig_on(void);
 
 static void enter_discharging(void);
-static uint16_t handle_discharging(void);
-static uint16_t handle_discharging_blocked(void);
-
-static uint16_t handle_fault(void);
+static void enter_discharging_blocked(void);
+
+/* ===== Transition table ===== */
+
+// All legal transitions. Rows are evaluated in order for the pending events, and the first row
+// whose guard is satisfied (and that leads to a different state) is taken. The table stays in
+// flash, which is memory-mapped on this device.
+static const Transition transitions[] = {
+    // Faults take precedence in every state
+    {CHARGER_ANY,                   EV_BQ,          is_fault,           CHARGER_FAULT},
+    {CHARGER_FAULT,                 EV_BQ,          is_no_fault,        CHARGER_PRE_FAULT},
+    {CHARGER_FAULT,                 EV_BQ,          is_no_input,        CHARGER_DISCONNECTED},
+
+    // OTG mode requested or ended by the PD policy engine
+    {CHARGER_ANY,                   EV_PPS,         is_otg_blocked,     CHARGER_DISCHARGING_BLOCKED},
+    {CHARGER_ANY,                   EV_PPS,         is_otg_enabled,     CHARGER_DISCHARGING},
+    {CHARGER_DISCHARGING,           EV_PPS,         is_otg_disabled,    CHARGER_DISCONNECTED},
+
+    {CHARGER_DISCONNECTED,          EV_BQ,          is_dc_present,      CHARGER_DC_CHARGING},
+    {CHARGER_DISCONNECTED,          EV_BQ | EV_PD,  is_usb_sink,        CHARGER_USB_NEGOTIATING},
+
+    {CHARGER_DC_CHARGING,           EV_KX2,         is_rig_inhibit,     CHARGER_RIG_ON},
+    {CHARGER_DC_CHARGING,           EV_BQ | EV_PD,  is_usb_sink,        CHARGER_USB_NEGOTIATING},
+    {CHARGER_DC_CHARGING,           EV_BQ,          is_no_input,        CHARGER_DISCONNECTED},
+
+    {CHARGER_USB_NEGOTIATING,       EV_KX2,         is_rig_inhibit,     CHARGER_RIG_ON},
+    {CHARGER_USB_NEGOTIATING,       EV_TIMER,       NULL,               CHARGER_USB_TYPE_C_CHARGING},
+    {CHARGER_USB_NEGOTIATING,       EV_PD,          has_contract,       CHARGER_USB_PD_CHARGING},
+    {CHARGER_USB_NEGOTIATING,       EV_BQ,          is_no_usb_input,    CHARGER_DISCONNECTED},
+
+    {CHARGER_USB_TYPE_C_CHARGING,   EV_KX2,         is_rig_inhibit,     CHARGER_RIG_ON},
+    {CHARGER_USB_TYPE_C_CHARGING,   EV_PD,          is_not_sink,        CHARGER_DISCONNECTED},
+    {CHARGER_USB_TYPE_C_CHARGING,   EV_PD,          has_contract,       CHARGER_USB_PD_CHARGING},
+
+    {CHARGER_USB_PD_CHARGING,       EV_KX2,         is_rig_inhibit,     CHARGER_RIG_ON},
+    {CHARGER_USB_PD_CHARGING,       EV_PD,          is_not_sink,        CHARGER_DISCONNECTED},
+    {CHARGER_USB_PD_CHARGING,       EV_PD,          has_no_contract,    CHARGER_USB_TYPE_C_CHARGING},
+
+    // Return to disconnected for a clean restart when the rig powers down or input power disappears
+    {CHARGER_RIG_ON,                EV_KX2,         is_rig_off,         CHARGER_DISCONNECTED},
+    {CHARGER_RIG_ON,                EV_BQ,          is_no_input,        CHARGER_DISCONNECTED},
+
+    // Role swap or disconnected
+    {CHARGER_DISCHARGING,           EV_PD,          is_not_source,      CHARGER_DISCONNECTED},
+    {CHARGER_DISCHARGING,           EV_ADC,         is_battery_low,     CHARGER_DISCHARGING_BLOCKED},
+    {CHARGER_DISCHARGING_BLOCKED,   EV_PD,          is_not_source,      CHARGER_DISCONNECTED},
+};
 
 /* ===== Initialization ===== */
 
 bool charger_sm_init(void) {
     current_state = CHARGER_DISCONNECTED;
     pre_fault_state = CHARGER_DISCONNECTED;
-    otg_voltage = 0;
-    otg_current = 0;
     discharging_low_battery = false;
     TimerDisable(&state_timer);
+
+    pd_conn_state = fsc_pd_get_connection_state();
+    pd_has_contract = fsc_pd_policy_has_contract();
+    pd_advertised_current = fsc_pd_get_advertised_current();
+
+    // Running average smooths out load transients for the low battery check in OTG mode
+    bq_adc_configure(BQ_ADC_15BIT, true);
+
+    // After a warm reset, the BQ keeps its state (e.g. charging continues while the state is
+    // derived from its status registers below), but the PD contract for OTG mode is gone.
+    // The PD stack starts before us though, so OTG mode may have been requested in the meantime.
+    initialized = true;
+    apply_otg_voltage();
+
+    // Evaluate the initial conditions on the first run
+    post_events(EV_LEVEL);
     return true;
 }
 
 /* ===== Event Handlers ===== */
 
 void charger_sm_on_bq_interrupt(void) {
-    // BQ interrupt will be detected by state machine checking hardware status
-    // No action needed here - state machine queries BQ directly
+    // The BQ status cache has just been refreshed
     //debug_printf("SM: BQ interrupt received\n");
+    post_events(EV_BQ);
 }
 
 void charger_sm_on_pd_state_change(void) {
-    // PD state will be detected by state machine checking connection state
-    // No action needed here - state machine queries fsc_pd directly
     debug_printf("SM: PD state change: %d, %d\n", fsc_pd_get_connection_state(), fsc_pd_get_policy_state());
+    post_events(EV_PD);
+}
+
+void charger_sm_on_kx2_power_change(void) {
+    post_events(EV_KX2);
 }
 
 void charger_sm_on_pps_voltage_update(uint16_t mv) {
@@ -82,15 +199,22 @@ void charger_sm_on_pps_voltage_update(uint16_t mv) {
     }
 
     otg_voltage = mv;
+    post_events(EV_PPS);
+
+    // Until charger_sm_init(), the BQ may not be configured yet; the request is applied there
+    if (initialized) {
+        apply_otg_voltage();
+    }
+}
 
+static void apply_otg_voltage(void) {
     // When PPS voltage is set to non-zero, PD has negotiated OTG mode
-    // Configure BQ and transition to DISCHARGING state
+    // Configure BQ right away; the state machine transitions to DISCHARGING on its next run
     if (otg_voltage > 0) {
         // Don't allow OTG if we've already hit the low battery limit
         // Must enter a charging state first to clear the flag
         if (discharging_low_battery) {
             debug_printf("SM: OTG mode rejected - must recharge first\n");
-            set_state(CHARGER_DISCHARGING_BLOCKED);
             return;
         }
 
@@ -106,26 +230,26 @@ void charger_sm_on_pps_voltage_update(uint16_t mv) {
             debug_printf("SM: Cannot enter OTG mode while DC jack is connected\n");
             return;
         }
+        bq_begin_update();
         bq_disable_charging();
         bq_set_acdrv(true, false);
         if (otg_current == 0) {
             // No current limit set yet - use configured default
             otg_current = sysconfig->otgCurrentLimit;
-            bq_set_otg_current_limit(otg_current);
         }
+        bq_set_otg_current_limit(otg_current);
         uint16_t otg_voltage_eff = otg_voltage;
         if (sysconfig->otgVoltageHeadroom <= 500) {
             // Limit headroom for safety
             otg_voltage_eff += sysconfig->otgVoltageHeadroom;
         }
         bq_enable_otg(otg_voltage_eff);
-        set_state(CHARGER_DISCHARGING);
+        bq_end_update();
+        otg_enabled = true;
     } else {
         // OTG mode ended
         bq_disable_otg();
-        if (current_state == CHARGER_DISCHARGING) {
-            set_state(CHARGER_DISCONNECTED);
-        }
+        otg_enabled = false;
     }
 }
 
@@ -140,70 +264,179 @@ void charger_sm_on_pps_current_update(uint16_t ma) {
     }
 
     otg_current = ma;
-    
-    // Configure BQ with the new current limit
-    bq_set_otg_current_limit(ma);
+
+    // Configure BQ with the new current limit (or on charger_sm_init())
+    if (initialized) {
+        bq_set_otg_current_limit(ma);
+    }
 }
 
 /* ===== State Machine Core ===== */
 
-/**
- * @brief Check if rig inhibit is active and transition to RIG_ON if needed
- * @return true if inhibited (transitioned to RIG_ON), false otherwise
- */
-static bool check_rig_inhibit(void) {
-    if (kx2_is_on() && !sysconfig->chargeWhenRigIsOn) {
-        set_state(CHARGER_RIG_ON);
-        return true;
+static void post_events(uint8_t events) {
+    pending_events |= events;
+}
+
+// Events that can be detected from state in RAM (without I2C traffic)
+static uint8_t poll_events(void) {
+    uint8_t events = 0;
+
+    ConnectionState conn = fsc_pd_get_connection_state();
+    bool contract = fsc_pd_policy_has_contract();
+    uint16_t adv_current = fsc_pd_get_advertised_current();
+    if (conn != pd_conn_state || contract != pd_has_contract || adv_current != pd_advertised_current) {
+        pd_conn_state = conn;
+        pd_has_contract = contract;
+        pd_advertised_current = adv_current;
+        events |= EV_PD;
     }
-    return false;
+
+    if (TimerExpired(&state_timer)) {
+        TimerDisable(&state_timer);
+        events |= EV_TIMER;
+    }
+
+    if (bq_adc_poll(BQ_ADC_CONSUMER_CHARGER)) {
+        events |= EV_ADC;
+    }
+
+    return events;
+}
+
+static ChargerState find_transition(uint8_t events) {
+    for (uint8_t i = 0; i < sizeof(transitions) / sizeof(transitions[0]); i++) {
+        const Transition *t = &transitions[i];
+        if (!(t->events & events)) {
+            continue;
+        }
+        if (t->from == CHARGER_ANY ? current_state == CHARGER_FAULT : t->from != current_state) {
+            continue;
+        }
+        ChargerState to = (t->to == CHARGER_PRE_FAULT) ? pre_fault_state : t->to;
+        if (to == current_state) {
+            continue;
+        }
+        if (t->guard == NULL || t->guard()) {
+            return to;
+        }
+    }
+    return current_state;
 }
 
 uint16_t charger_sm_run(void) {
-    //debug_printf("SM: Current state: %d\n", current_state);
+    uint8_t events = pending_events | poll_events();
+    pending_events = 0;
 
-    // Check for faults every cycle
-    check_fault_conditions();
+    // Nothing to do unless something has happened
+    if (events == 0) {
+        return TimerRemaining(&state_timer);
+    }
 
-    // Dispatch to state-specific handler
-    uint16_t timeout = 0;
-    switch (current_state) {
-        case CHARGER_DISCONNECTED:
-            timeout = handle_disconnected();
-            break;
-        case CHARGER_DC_CHARGING:
-            timeout = handle_dc_charging();
-            break;
-        case CHARGER_USB_NEGOTIATING:
-            timeout = handle_usb_negotiating();
+    //debug_printf("SM: Events %x in state %d\n", events, current_state);
+
+    // Follow transitions until the state is stable. The conditions of a newly entered state
+    // are evaluated right away; the bound guards against ping-pong between states.
+    for (uint8_t i = 0; i < CHARGER_STATE_COUNT; i++) {
+        ChargerState next_state = find_transition(events);
+        if (next_state == current_state) {
             break;
+        }
+        set_state(next_state);
+        events = EV_LEVEL;
+    }
+
+    handle_events(events);
+    update_led_for_state();
+    update_charge_session();
+
+    return TimerRemaining(&state_timer);
+}
+
+// Actions within a state that don't cause a transition
+static void handle_events(uint8_t events) {
+    switch (current_state) {
         case CHARGER_USB_TYPE_C_CHARGING:
-            timeout = handle_usb_type_c_charging();
+            handle_usb_type_c_charging(events);
             break;
         case CHARGER_USB_PD_CHARGING:
-            timeout = handle_usb_pd_charging();
-            break;
-        case CHARGER_RIG_ON:
-            timeout = handle_rig_on();
-            break;
-        case CHARGER_DISCHARGING:
-            timeout = handle_discharging();
-            break;
-        case CHARGER_DISCHARGING_BLOCKED:
-            timeout = handle_discharging_blocked();
-            break;
-        case CHARGER_FAULT:
-            timeout = handle_fault();
+            handle_usb_pd_charging(events);
             break;
         default:
-            // Reserved/unused states - fall back to disconnected
-            set_state(CHARGER_DISCONNECTED);
             break;
     }
+}
 
-    update_led_for_state();
+/* ===== Transition guards ===== */
+
+static bool is_fault(void) {
+    return bq_get_fault_status() != 0;
+}
+
+static bool is_no_fault(void) {
+    return bq_get_fault_status() == 0;
+}
+
+static bool is_no_input(void) {
+    return !bq_get_ac1_present() && !bq_get_ac2_present();
+}
+
+static bool is_no_usb_input(void) {
+    return !bq_get_ac1_present();
+}
 
-    return timeout;
+static bool is_dc_present(void) {
+    return bq_get_ac2_present();
+}
+
+static bool is_usb_sink(void) {
+    // DC jack takes precedence
+    return !bq_get_ac2_present() && bq_get_ac1_present() && fsc_pd_get_connection_state() == AttachedSink;
+}
+
+static bool is_not_sink(void) {
+    return fsc_pd_get_connection_state() != AttachedSink;
+}
+
+static bool is_not_source(void) {
+    return fsc_pd_get_connection_state() != AttachedSource;
+}
+
+static bool has_contract(void) {
+    return fsc_pd_policy_has_contract();
+}
+
+static bool has_no_contract(void) {
+    return !fsc_pd_policy_has_contract();
+}
+
+static bool is_rig_inhibit(void) {
+    return kx2_is_on() && !sysconfig->chargeWhenRigIsOn;
+}
+
+static bool is_rig_off(void) {
+    return !kx2_is_on();
+}
+
+static bool is_otg_blocked(void) {
+    return otg_voltage > 0 && discharging_low_battery;
+}
+
+static bool is_otg_enabled(void) {
+    return otg_enabled;
+}
+
+static bool is_otg_disabled(void) {
+    return !otg_enabled;
+}
+
+static bool is_battery_low(void) {
+    uint16_t vbat = bq_read_adc_snapshot()->vbat;
+    if (vbat < sysconfig->dischargingVoltageLimit) {
+        debug_printf("SM: Battery voltage too low for discharging: %u mV < %u mV\n",
+                    vbat, sysconfig->dischargingVoltageLimit);
+        return true;
+    }
+    return false;
 }
 
 /* ================================================================================
@@ -213,9 +446,10 @@ uint16_t charger_sm_run(void) {
 static void enter_disconnected(void) {
     bq_disable_charging();
     bq_disable_otg();
-    bq_disable_adc();
+    bq_adc_request(BQ_ADC_CONSUMER_CHARGER, 0, 0);
     otg_voltage = 0;
     otg_current = 0;
+    otg_enabled = false;
     led_shutdown();
 }
 
@@ -223,18 +457,6 @@ static void exit_disconnected(void) {
     led_wakeup();
 }
 
-static uint16_t handle_disconnected(void) {
-    // Check if any input available
-    if (bq_get_ac2_present()) {
-        set_state(CHARGER_DC_CHARGING);
-    } else if (bq_get_ac1_present()) {
-        if (fsc_pd_get_connection_state() == AttachedSink) {
-            set_state(CHARGER_USB_NEGOTIATING);
-        }
-    }
-    return 0;
-}
-
 /* ================================================================================
  * CHARGER_DC_CHARGING - DC jack connected
  * ================================================================================ */
@@ -243,34 +465,13 @@ static void enter_dc_charging(void) {
     discharging_low_battery = false;  // Clear low battery flag when entering charging
     bq_set_acdrv(false, true);
     bq_set_input_current_limit(sysconfig->dcInputCurrentLimit);
-    bq_enable_adc();
-    
+    bq_adc_request(BQ_ADC_CONSUMER_CHARGER, BQ_ADC_IBAT, ADC_INTERVAL_TICKS);
+
     if (!kx2_is_on() || sysconfig->chargeWhenRigIsOn) {
         bq_enable_charging();
     }
 }
 
-static uint16_t handle_dc_charging(void) {
-    // Check if KX2 turned on
-    if (check_rig_inhibit()) {
-        return 0;
-    }
-    
-    // DC jack charging
-    if (!bq_get_ac2_present()) {
-        // DC removed, check USB
-        if (bq_get_ac1_present()) {
-            ConnectionState conn = fsc_pd_get_connection_state();
-            if (conn == AttachedSink) {
-                set_state(CHARGER_USB_NEGOTIATING);
-            }
-        } else {
-            set_state(CHARGER_DISCONNECTED);
-        }
-    }
-    return 0;
-}
-
 /* ================================================================================
  * CHARGER_USB_NEGOTIATING - USB attached, waiting for PD negotiation
  * ================================================================================ */
@@ -285,26 +486,6 @@ static void enter_usb_negotiating(void) {
     TimerStart(&state_timer, 3000); // 3s negotiation timeout
 }
 
-static uint16_t handle_usb_negotiating(void) {
-    // Check if KX2 turned on
-    if (check_rig_inhibit()) {
-        return 0;
-    }
-    
-    // Check negotiation timeout
-    if (TimerExpired(&state_timer)) {
-        // Negotiation timeout - fall back to Type-C
-        set_state(CHARGER_USB_TYPE_C_CHARGING);
-    } else if (fsc_pd_policy_has_contract()) {
-        // Contract established
-        set_state(CHARGER_USB_PD_CHARGING);
-    } else if (!bq_get_ac1_present()) {
-        // USB disconnected
-        set_state(CHARGER_DISCONNECTED);
-    }
-    return TimerRemaining(&state_timer);
-}
-
 /* ================================================================================
  * CHARGER_USB_TYPE_C_CHARGING - USB Type-C without PD
  * ================================================================================ */
@@ -323,30 +504,20 @@ static void enter_usb_type_c_charging(void) {
         bq_disable_bc12_detection();
         bq_set_input_current_limit(adv_current);
     }
-    
-    bq_enable_adc();
+
+    bq_adc_request(BQ_ADC_CONSUMER_CHARGER, BQ_ADC_IBAT, ADC_INTERVAL_TICKS);
     bq_enable_charging();
 }
 
-static uint16_t handle_usb_type_c_charging(void) {
-    // Check if KX2 turned on
-    if (check_rig_inhibit()) {
-        return 0;
-    }
-    
+static void handle_usb_type_c_charging(uint8_t events) {
     // Monitor advertised current changes
-    uint16_t adv_current = fsc_pd_get_advertised_current();
-    if (adv_current != 500) {
-        // Type-C current changed - update BQ
-        bq_set_input_current_limit(adv_current);
-    }
-    
-    if (fsc_pd_get_connection_state() != AttachedSink) {
-        set_state(CHARGER_DISCONNECTED);
-    } else if (fsc_pd_policy_has_contract()) {
-        set_state(CHARGER_USB_PD_CHARGING);
+    if (events & EV_PD) {
+        uint16_t adv_current = fsc_pd_get_advertised_current();
+        if (adv_current != 500) {
+            // Type-C current changed - update BQ
+            bq_set_input_current_limit(adv_current);
+        }
     }
-    return 0;
 }
 
 /* ================================================================================
@@ -357,29 +528,18 @@ static void enter_usb_pd_charging(void) {
     discharging_low_battery = false;  // Clear low battery flag when entering charging
     // PD contract established
     uint16_t adv_current = fsc_pd_get_advertised_current();
-    
+
     bq_disable_bc12_detection();
     bq_set_input_current_limit(adv_current);
-    bq_enable_adc();
+    bq_adc_request(BQ_ADC_CONSUMER_CHARGER, BQ_ADC_IBAT, ADC_INTERVAL_TICKS);
     bq_enable_charging();
 }
 
-static uint16_t handle_usb_pd_charging(void) {
-    // Check if KX2 turned on
-    if (check_rig_inhibit()) {
-        return 0;
-    }
-    
+static void handle_usb_pd_charging(uint8_t events) {
     // Monitor advertised current changes
-    uint16_t adv_current = fsc_pd_get_advertised_current();
-    bq_set_input_current_limit(adv_current);
-    
-    if (fsc_pd_get_connection_state() != AttachedSink) {
-        set_state(CHARGER_DISCONNECTED);
-    } else if (!fsc_pd_policy_has_contract()) {
-        set_state(CHARGER_USB_TYPE_C_CHARGING);
+    if (events & EV_PD) {
+        bq_set_input_current_limit(fsc_pd_get_advertised_current());
     }
-    return 0;
 }
 
 /* ================================================================================
@@ -390,77 +550,23 @@ static void enter_rig_on(void) {
     bq_disable_charging();
 }
 
-static uint16_t handle_rig_on(void) {
-    // Rig powered, charging inhibited
-    if (!kx2_is_on()) {
-        // Rig powered down - return to disconnected for clean restart
-        set_state(CHARGER_DISCONNECTED);
-    } else if (!bq_get_ac1_present() && !bq_get_ac2_present()) {
-        // Input power disappeared while rig is on
-        set_state(CHARGER_DISCONNECTED);
-    }
-    return 0;
-}
-
 /* ================================================================================
  * CHARGER_DISCHARGING - OTG mode (providing power)
  * ================================================================================ */
 
 static void enter_discharging(void) {
-    bq_enable_adc();
-}
-
-static uint16_t handle_discharging(void) {
-    // OTG mode (providing power)
-    ConnectionState conn = fsc_pd_get_connection_state();
-    if (conn != AttachedSource) {
-        // Role swap or disconnected
-        bq_disable_otg();
-        set_state(CHARGER_DISCONNECTED);
-        return 0;
-    }
-
-    // Monitor battery voltage during discharging
-    uint16_t vbat = bq_measure_vbat();
-    if (vbat < sysconfig->dischargingVoltageLimit) {
-        if (!discharging_low_battery) {
-            discharging_low_battery = true;
-            debug_printf("SM: Battery voltage too low for discharging: %u mV < %u mV\n", 
-                        vbat, sysconfig->dischargingVoltageLimit);
-            bq_disable_otg();
-            set_state(CHARGER_DISCHARGING_BLOCKED);
-        }
-    }
-    
-    return 0;
+    bq_adc_request(BQ_ADC_CONSUMER_CHARGER, BQ_ADC_VBAT | BQ_ADC_IBAT, ADC_INTERVAL_TICKS);
 }
 
 /* ================================================================================
  * CHARGER_DISCHARGING_BLOCKED - OTG mode blocked due to low battery
  * ================================================================================ */
 
-static uint16_t handle_discharging_blocked(void) {
-    // OTG mode was requested but blocked due to low battery
-    
-    if (fsc_pd_get_connection_state() != AttachedSource) {
-        // Role swap or disconnected
-        set_state(CHARGER_DISCONNECTED);
-        return 0;
-    }
-    
-    return 0;
-}
-
-/* ================================================================================
- * CHARGER_FAULT - Fault condition detected
- * ================================================================================ */
-
-static uint16_t handle_fault(void) {
-    // Stay in fault state until input is disconnected
-    if (!bq_get_ac1_present() && !bq_get_ac2_present()) {
-        set_state(CHARGER_DISCONNECTED);
-    }
-    return 0;
+static void enter_discharging_blocked(void) {
+    // OTG mode is not allowed again until we have been charging
+    discharging_low_battery = true;
+    bq_disable_otg();
+    otg_enabled = false;
 }
 
 /* ===== State transition handling ===== */
@@ -475,9 +581,18 @@ static void set_state(ChargerState new_state) {
 
     debug_printf("SM: State transition %d -> %d\n", previous_state, new_state);
 
+    if (new_state == CHARGER_FAULT) {
+        // Stay in fault state until the fault clears or input is disconnected
+        pre_fault_state = previous_state;
+        debug_printf("SM: Fault detected: %x\n", bq_get_fault_status());
+    }
+
     // Disable any active timers when changing state
     TimerDisable(&state_timer);
 
+    // Collect the charger configuration changes of the exit and entry handlers
+    bq_begin_update();
+
     // Call exit handler for previous state
     switch (previous_state) {
         case CHARGER_DISCONNECTED:
@@ -510,11 +625,14 @@ static void set_state(ChargerState new_state) {
         case CHARGER_DISCHARGING:
             enter_discharging();
             break;
+        case CHARGER_DISCHARGING_BLOCKED:
+            enter_discharging_blocked();
+            break;
         default:
             break;
     }
 
-    update_led_for_state();
+    bq_end_update();
 }
 
 static void update_led_for_state(void) {
@@ -545,7 +663,7 @@ static void update_led_for_state(void) {
             // Show red blinking to indicate battery too low for OTG
             led_set_blinking(true, false, false, 255, 5, 5, 15, 0);  // Red blinking at 2 Hz
             break;
-        
+
         default:
             led_off();
             break;
@@ -563,7 +681,7 @@ static void update_charging_led(void) {
     } else {
         // Color depends on temperature - green (or blue) for normal, yellow (or cyan) for warm/cool
         bool warm_cool = (temp_status & (TEMP_WARM | TEMP_COOL)) ? true : false;
-        int16_t battery_current = bq_measure_ibat();
+        int16_t battery_current = bq_read_adc_snapshot()->ibat;
 
         if (current_state == CHARGER_DISCHARGING) {
             battery_current = -battery_current;
@@ -600,20 +718,36 @@ static void update_charging_led(void) {
     }
 }
 
-static void check_fault_conditions(void) {
-    // Detect new faults
-    if (bq_get_fault_status() != 0) {
-        if (current_state != CHARGER_FAULT) {
-            pre_fault_state = current_state;
-            debug_printf("SM: Fault detected: %x\n", bq_get_fault_status());
-            set_state(CHARGER_FAULT);
-        }
-    } else {
-        // No fault
-        if (current_state == CHARGER_FAULT) {
-            debug_printf("SM: Fault cleared, returning to state %d\n", pre_fault_state);
-            set_state(pre_fault_state);
-        }
+// Measure the time from the start of charging until the BQ reports that charging is done.
+// Negotiation belongs to the session, as the BQ charges with the default input current limits
+// in the meantime; any other state ends it.
+static void update_charge_session(void) {
+    bool charging;
+    switch (current_state) {
+        case CHARGER_DC_CHARGING:
+        case CHARGER_USB_NEGOTIATING:
+        case CHARGER_USB_TYPE_C_CHARGING:
+        case CHARGER_USB_PD_CHARGING:
+            charging = true;
+            break;
+        default:
+            charging = false;
+            break;
+    }
+
+    if (!charging) {
+        charge_session = false;
+        return;
+    }
+    if (!charge_session) {
+        charge_session = true;
+        charge_full = false;
+        charge_start = rtc_get_ticks32();
+    }
+    if (!charge_full && bq_get_charge_status() == CHARGE_DONE) {
+        charge_full = true;
+        time_to_full = (rtc_get_ticks32() - charge_start) / 1024;
+        debug_printf("SM: Charging done after %lu s\n", time_to_full);
     }
 }
 
@@ -622,3 +756,7 @@ static void check_fault_conditions(void) {
 ChargerState charger_sm_get_state(void) {
     return current_state;
 }
+
+uint32_t charger_sm_get_time_to_full(void) {
+    return time_to_full;
+}
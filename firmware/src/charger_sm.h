@@ -25,8 +25,9 @@ typedef enum {
 /**
  * @brief Initialize the charger state machine
  *
- * Must be called during system startup after BQ, PD, and platform subsystems
- * are initialized.
+ * Must be called during system startup once the BQ is configured (see
+ * bq_init_pending()). The PD stack may already be running; OTG mode requested
+ * by it in the meantime is applied here.
  *
  * @return true if initialization successful, false otherwise
  */
@@ -35,8 +36,10 @@ bool charger_sm_init(void);
 /**
  * @brief Run the state machine
  *
- * Should be called regularly from the main event loop. Processes state
- * transitions and performs state-specific actions.
+ * Should be called from the main event loop after each wakeup. Collects pending
+ * events (and detects PD, timer and ADC events from state in RAM), and only if
+ * there are any, processes state transitions according to the transition table
+ * and performs state-specific actions.
  *
  * @return Ticks until next required update, or 0 if no specific timeout is pending. Use to set RTC alarm.
  */
@@ -47,8 +50,8 @@ uint16_t charger_sm_run(void);
 /**
  * @brief Notify state machine of BQ charger interrupt
  *
- * Called when BQ_INT pin asserts (from ISR context or polled).
- * Reasons for interrupt:
+ * Called from the main loop when bq_process_interrupts() reports a change
+ * of the cached BQ status. Reasons for interrupt:
  * - ACx_PRESENT changed
  * - Charging status changed
  * - Fault detected
@@ -56,6 +59,13 @@ uint16_t charger_sm_run(void);
  */
 void charger_sm_on_bq_interrupt(void);
 
+/**
+ * @brief Notify state machine of KX2 power state change
+ *
+ * Called from the main loop for EVENT_KX2_POWER.
+ */
+void charger_sm_on_kx2_power_change(void);
+
 /**
  * @brief Notify state machine of FUSB302/PD state change
  *
@@ -92,3 +102,13 @@ void charger_sm_on_pps_current_update(uint16_t ma);
  * @return Current ChargerState
  */
 ChargerState charger_sm_get_state(void);
+
+/**
+ * @brief Get the duration of the last completed charging session
+ *
+ * Measured from entering a charging state until the BQ reported that charging
+ * is done. Sessions that end before are not counted.
+ *
+ * @return Seconds, or 0 if no charging session has completed yet
+ */
+uint32_t charger_sm_get_time_to_full(void);
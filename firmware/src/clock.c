@@ -8,6 +8,6 @@ void clock_init(void) {
     ccp_write_io((void*)&(CLKCTRL.MCLKCTRLB), 0);
     // LOCKEN enabled
     ccp_write_io((void*)&(CLKCTRL.MCLKLOCK), CLKCTRL_LOCKEN_bm);
-    // RUNSTDBY disabled by default (may be enabled later if KX2 is on)
+    // RUNSTDBY disabled, the RTC SPI emulation does not need OSC20M in standby
     ccp_write_io((void*)&(CLKCTRL.OSC20MCTRLA), 0);
 }
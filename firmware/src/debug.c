@@ -70,7 +70,7 @@ static int uart_putchar(char c, FILE *stream) {
 
 void debug_printf(const char *fmt, ...) {
     va_list args;
-    printf("[%u] ", rtc_get_ticks());
+    printf("[%lu] ", rtc_get_ticks32());
     va_start(args, fmt);
     vprintf(fmt, args);
     va_end(args);
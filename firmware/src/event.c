@@ -0,0 +1,61 @@
+/*
+ * Single-producer/single-consumer event queue from ISRs to the main loop.
+ *
+ * Only ISRs post events, and as they don't nest, there is only ever one writer of head.
+ * Only the main loop reads events and writes tail. Both indexes are single bytes, so no
+ * locking is needed.
+ */
+#include "event.h"
+#include "rtc.h"
+
+#define EVENT_QUEUE_SIZE 8  // Must be a power of two
+
+static Event queue[EVENT_QUEUE_SIZE];
+static volatile uint8_t head = 0;
+static volatile uint8_t tail = 0;
+
+static volatile uint8_t overflows = 0;
+static uint16_t max_latency = 0;
+
+bool event_post(uint8_t type, uint8_t data) {
+    uint8_t next_head = (head + 1) & (EVENT_QUEUE_SIZE - 1);
+    if (next_head == tail) {
+        if (overflows < 0xFF) {
+            overflows++;
+        }
+        return false;
+    }
+    Event *event = &queue[head];
+    event->type = type;
+    event->data = data;
+    event->timestamp = rtc_get_ticks();
+    head = next_head;
+    return true;
+}
+
+bool event_get(Event *event) {
+    uint8_t t = tail;
+    if (t == head) {
+        return false;
+    }
+    *event = queue[t];
+    tail = (t + 1) & (EVENT_QUEUE_SIZE - 1);
+
+    uint16_t latency = rtc_get_ticks() - event->timestamp;
+    if (latency > max_latency) {
+        max_latency = latency;
+    }
+    return true;
+}
+
+bool event_pending(void) {
+    return head != tail;
+}
+
+uint16_t event_get_max_latency(void) {
+    return max_latency;
+}
+
+uint8_t event_get_overflows(void) {
+    return overflows;
+}
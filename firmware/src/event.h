@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Events posted by ISRs and handled by the main loop, in order of occurrence
+typedef enum {
+    EVENT_BQ_INT = 1,       // BQ_INT asserted
+    EVENT_FUSB_INT,         // FUSB_INT asserted (pin interrupt stays disabled until the next fsc_pd_run())
+    EVENT_KX2_POWER,        // KX2 power sense pin toggled; data: 1 = on
+    EVENT_BUTTON,           // Button released; data: ButtonPress
+    EVENT_RTC_OFFSET,       // KX2 wrote the PCF2123 offset register; data: register value
+    EVENT_RTC_TIME_SET,     // KX2 wrote the time registers (see rtc_handle_time_set())
+    EVENT_ADC,              // ADC0 conversion complete; data: AdcChannel
+    EVENT_TWI_ERROR         // TWI bus stuck; recovery pending (see twi_run())
+} EventType;
+
+typedef struct {
+    uint8_t type;
+    uint8_t data;
+    uint16_t timestamp;     // RTC ticks at the time of posting
+} Event;
+
+// Post an event. Must only be called from ISR context or with interrupts disabled (as ISRs don't
+// nest, they form a single producer). Returns false if the queue is full and the event was dropped.
+bool event_post(uint8_t type, uint8_t data);
+
+// Get the oldest pending event. Must only be called from the main loop (single consumer).
+// Returns false if there is none.
+bool event_get(Event *event);
+bool event_pending(void);
+
+// Worst-case time between posting and getting an event, in ticks
+uint16_t event_get_max_latency(void);
+// Number of events dropped due to a full queue
+uint8_t event_get_overflows(void);
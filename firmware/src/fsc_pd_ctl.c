@@ -2,12 +2,10 @@
 #include "vendor_info.h"
 #include "sysconfig.h"
 #include "charger_sm.h"
-#include "insomnia.h"
+#include "event.h"
 #include "twi.h"
 #include "debug.h"
 
-#define FUSB302_I2C_ADDR 0x22
-
 static DevicePolicyPtr_t dpm;
 static Port_t port;
 
@@ -54,6 +52,14 @@ void fsc_pd_init(void) {
 
     register_observer(EVENT_ALL, fsc_pd_event_handler, NULL);
 
+    // PD timing is tight (e.g. 1 ms for a manual GoodCRC with FSC_GSCE_FIX), so let FUSB302
+    // accesses jump ahead of pending LED and BQ traffic on the shared bus
+    twi_set_priority(FUSB302_I2C_ADDR, TWI_PRIORITY_HIGH);
+#ifdef TWI_FAST_MODE_PLUS
+    // Shorter register bursts; requires fast enough rise times (see twi_benchmark())
+    twi_set_speed(FUSB302_I2C_ADDR, TWI_SPEED_1M);
+#endif
+
     // FUSB_INT pin
     PORTA.PIN5CTRL = PORT_ISC_LEVEL_gc | PORT_PULLUPEN_bm;
 }
@@ -80,12 +86,12 @@ void fsc_pd_notify_interrupt(void) {
     // Note: called from ISR context
     // Disable further interrupts until we process this one
     PORTA.PIN5CTRL &= ~PORT_ISC_LEVEL_gc;
-    insomnia_mask |= INSOMNIA_FSC_PD;
+    // The pending event keeps the main loop from going to sleep before calling fsc_pd_run()
+    event_post(EVENT_FUSB_INT, 0);
 }
 
 void fsc_pd_enable_interrupt(void) {
     // Re-enable FUSB_INT pin interrupt
-    insomnia_mask &= ~INSOMNIA_FSC_PD;
     PORTA.PIN5CTRL |= PORT_ISC_LEVEL_gc;
 }
 
@@ -110,7 +116,7 @@ bool fsc_pd_policy_has_contract(void) {
 }
 
 void fsc_pd_swap_roles(void) {
-    // Note: this is called from an ISR context (button press handler)
+    // Called from the main loop (button short press handler)
     if (port.PolicyState == peSinkReady) {
         port.PortConfig.reqPRSwapAsSnk = TRUE;
     } else if (port.PolicyState == peSourceReady) {
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#define FUSB302_I2C_ADDR 0x22
+
 void fsc_pd_init(void);
 bool fsc_pd_test_connection(void);
 uint16_t fsc_pd_run(void);
@@ -4,6 +4,10 @@
 
 #define INSOMNIA_DEBUG_TX (1 << 0)
 #define INSOMNIA_RTC_SPI  (1 << 1)
-#define INSOMNIA_FSC_PD   (1 << 2)
+#define INSOMNIA_ADC      (1 << 2)  // Only requires idle sleep mode
+#define INSOMNIA_TWI      (1 << 3)  // Only requires idle sleep mode
+
+// Bits that still allow idle sleep mode (peripheral clock keeps running)
+#define INSOMNIA_IDLE_OK (INSOMNIA_ADC | INSOMNIA_TWI)
 
 extern volatile uint8_t insomnia_mask;
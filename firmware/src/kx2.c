@@ -1,6 +1,6 @@
 #include "kx2.h"
+#include "event.h"
 
-#include <avr/cpufunc.h>
 #include <avr/io.h>
 
 void kx2_init(void) {
@@ -13,15 +13,8 @@ bool kx2_is_on(void) {
 }
 
 void kx2_handle_interrupt(void) {
-    // This function can be expanded if any special handling is needed
-    // when the KX2 power state changes.
-    if (kx2_is_on()) {
-        // KX2 powered on - make OSC20M run in standby as we need to be ready
-        // to respond to SPI requests within 10 us of RTC_CS being asserted, but
-        // the start up time of OSC20M alone is already 12 us.
-        ccp_write_io((void*)&(CLKCTRL.OSC20MCTRLA), CLKCTRL_RUNSTDBY_bm);
-    } else {
-        // KX2 powered off - can disable RUNSTDBY to save power
-        ccp_write_io((void*)&(CLKCTRL.OSC20MCTRLA), 0);
-    }
+    // Note that OSC20M doesn't need to run in standby while the KX2 is on, even though its
+    // start up time (12 us) exceeds the time we have to respond to SPI requests after
+    // RTC_CS is asserted, as the first response byte is preloaded (see rtc_spi_preload()).
+    event_post(EVENT_KX2_POWER, kx2_is_on());
 }
@@ -4,8 +4,6 @@
 #include <avr/io.h>
 #include <util/delay.h>
 
-#define LP5815_ADDR 0x2D
-
 static void led_stop_animation(void);
 
 typedef enum {
@@ -30,11 +28,16 @@ typedef struct {
 
 static LedState current_state;
 
-static bool led_write_register(uint8_t reg, uint8_t value) {
-    return twi_send_bytes(LP5815_ADDR, (uint8_t[]){reg, value}, 2);
+static void led_write_register(uint8_t reg, uint8_t value) {
+    // Nobody waits for LED updates, so just queue them
+    twi_send_bytes_async(LP5815_ADDR, (uint8_t[]){reg, value}, 2);
 }
 
 void led_init(void) {
+#ifdef TWI_FAST_MODE_PLUS
+    twi_set_speed(LP5815_ADDR, TWI_SPEED_1M);
+#endif
+
     // Reset
     led_write_register(0x0E, 0xCC);
 
@@ -304,12 +307,17 @@ void led_shutdown(void) {
 
 void led_wakeup(void) {
     // Special wakeup procedure: generate at least 8 falling edges on SDA while SCL is high
+    twi_flush();
     TWI0.MCTRLA &= ~TWI_ENABLE_bm;
     PORTB.OUTSET = PIN0_bm;
     for (uint8_t i = 0; i <= 20; i++) {
         PORTB.OUTTGL = PIN1_bm;
         _delay_us(10);
     }
+    // Leave OUT low, as twi_recover_bus() expects. SCL first, so that SDA doesn't fall while
+    // SCL is high (START condition).
+    PORTB.OUTCLR = PIN0_bm;
+    PORTB.OUTCLR = PIN1_bm;
     TWI0.MCTRLA |= TWI_ENABLE_bm;
     led_init();
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#define LP5815_ADDR 0x2D
+
 void led_init(void);
 void led_off(void);
 void led_set_color(bool red, bool green, bool blue, uint8_t brightness);
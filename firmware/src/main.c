@@ -1,7 +1,6 @@
 #include <avr/io.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include <util/delay.h>
 #include <stdio.h>
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
@@ -20,6 +19,11 @@
 #include "insomnia.h"
 #include "kx2.h"
 #include "watchdog.h"
+#include "event.h"
+#include "sched.h"
+#include "adc.h"
+#include "profile.h"
+#include "power.h"
 
 #ifdef DEBUG
 #define DEBUG_STATUS
@@ -29,6 +33,25 @@
 static void bq_print_status(void);
 #endif
 
+// Startup steps that take a while run from the main loop, so that USB PD is serviced from the
+// start (a sink expecting VBUS or a source may be attached during startup)
+typedef enum {
+    BOOT_BQ_RESET,      // waiting for the BQ register reset to complete
+    BOOT_BLINK,         // power-up blink, cut short if USB is attached
+    BOOT_DONE
+} BootStep;
+
+// Power-up blink duration: 3 x 0.2 s on, 0.2 s off
+#define BOOT_BLINK_TICKS 1229
+
+static BootStep boot_step;
+static bool boot_blink;
+
+static void handle_events(void);
+static void boot_run(void);
+static void boot_finish(void);
+static void bq_init_failed(void);
+
 #ifdef DEBUG
 ISR(BADISR_vect) {
     debug_printf("Bad interrupt\n");
@@ -37,6 +60,9 @@ ISR(BADISR_vect) {
 
 int main(void) {
     clock_init();
+#ifdef PROFILE
+    profile_init();
+#endif
     watchdog_init();
     debug_init();
     twi_init();
@@ -45,6 +71,7 @@ int main(void) {
     if (!sysconfig_valid()) {
         debug_printf("Invalid EEPROM configuration\n");
         led_set_blinking(true, false, false, 255, 5, 5, 4, 11);  // Red blinking, 4 x at 2 Hz with 1 second pause
+        twi_flush();
         while (1);
     }
     kx2_init();
@@ -54,85 +81,138 @@ int main(void) {
     // Enable global interrupts (also used for serial debug output)
     sei();
     
-    debug_printf("Startup, reset flags %x\n", RSTCTRL.RSTFR);
+    uint8_t reset_flags = RSTCTRL.RSTFR;
+    debug_printf("Startup, reset flags %x\n", reset_flags);
     RSTCTRL.RSTFR = 0xFF; // Clear reset flags
-    
-    if (!bq_init(sysconfig->chargingVoltageLimit, sysconfig->chargingCurrentLimit)) {
-        debug_printf("BQ init failed\n");
-        led_set_blinking(true, false, false, 255, 5, 5, 3, 11);  // Red blinking, 3 x at 2 Hz with 1 second pause
-        while (1);
+
+    // Warm reset (watchdog, long button press): the BQ has kept running, possibly charging.
+    // After power up or programming via UPDI, start from scratch.
+    bool warm = (reset_flags & (RSTCTRL_WDRF_bm | RSTCTRL_SWRF_bm | RSTCTRL_EXTRF_bm))
+                && !(reset_flags & (RSTCTRL_PORF_bm | RSTCTRL_BORF_bm | RSTCTRL_UPDIRF_bm));
+    power_init(warm);
+
+    if (!bq_init(sysconfig->chargingVoltageLimit, sysconfig->chargingCurrentLimit, warm)) {
+        bq_init_failed();
     }
-    bq_set_thermistor(sysconfig->enableThermistor);
 
     fsc_pd_init();
-    charger_sm_init();
+#ifdef TWI_BENCHMARK
+    // Registers without side effects on reading
+    twi_benchmark(FUSB302_I2C_ADDR, 0x01, 6);
+    twi_benchmark(BQ_ADDR, 0x00, 8);
+    twi_benchmark(LP5815_ADDR, 0x00, 2);
+#endif
     button_set_short_press_handler(fsc_pd_swap_roles);
 
-    // Power up blink
-    for (uint8_t i = 0; i < 3; i++) {
-        led_set_color(true, true, true, 255);
-        _delay_ms(200);
-        led_off();
-        _delay_ms(200);
+    // Power up blink (not after a warm reset, to resume as quickly as possible)
+    boot_blink = !warm;
+    if (boot_blink) {
+        led_set_blinking(true, true, true, 255, 4, 4, 3, 15);  // White blinking, 3 x at 2.5 Hz
+    }
+
+    // The charger state machine starts once the BQ is configured and the power-up blink is over
+    if (bq_init_pending()) {
+        boot_step = BOOT_BQ_RESET;
+        sched_set(SCHED_BOOT, BQ_RESET_TICKS);
+    } else {
+        boot_finish();
     }
-    led_shutdown();
+
+#ifdef DEBUG
+    bool pd_started = false;
+#endif
 
     while (1) {
+        // Handle everything the ISRs have reported since the last iteration
+        handle_events();
+        twi_run();
+
         if (button_handle_config_menu()) {
             // In config menu - skip normal processing
             watchdog_tickle();
             continue;
         }
 
-        // Run PD state machine - returns a timeout in ticks until next required wakeup,
-        // or 0 if no wakeup is needed and we can sleep until the next interrupt
-        uint16_t next_timeout = fsc_pd_run();
-
-        // Process BQ interrupts and notify state machine
-        if (bq_process_interrupts()) {
-            charger_sm_on_bq_interrupt();
+#ifdef DEBUG
+        if (!pd_started) {
+            // Time from rtc_init() (shortly after reset) until USB PD is first serviced
+            pd_started = true;
+            debug_printf("Boot to first PD run: %lu ticks\n", rtc_get_ticks32());
         }
+#endif
 
-        // Run charger state machine - returns a timeout in ticks until the next required wakeup,
+        // Run PD state machine - returns a timeout in ticks until next required wakeup,
         // or 0 if no wakeup is needed and we can sleep until the next interrupt
-        uint16_t sm_timeout = charger_sm_run();
-        if (sm_timeout > 0 && (sm_timeout < next_timeout || next_timeout == 0)) {
-            next_timeout = sm_timeout;
+        {
+            PROFILE_BEGIN();
+            sched_set(SCHED_PD, fsc_pd_run());
+            PROFILE_END(PROFILE_PD_RUN);
         }
 
-        // Enter low-power mode until next RTC alarm or other interrupt
-        // Don't enter sleep if we need to wake up soon (otherwise we may miss the alarm)
-        if (next_timeout == 0 || next_timeout >= 100) {
-            if (next_timeout != 0) {
-                rtc_set_alarm(next_timeout);
+        if (boot_step != BOOT_DONE) {
+            boot_run();
+        } else {
+            // Process BQ interrupts and notify state machine
+            if (bq_process_interrupts()) {
+                charger_sm_on_bq_interrupt();
             }
 
-            // Only enter sleep mode if no insomnia mask bits are set;
+            // Run BQ ADC conversions requested by the state machine (or debug status output)
+            sched_set(SCHED_BQ_ADC, bq_adc_run());
+
+            // Run charger state machine (same timeout semantics as above)
+            PROFILE_BEGIN();
+            sched_set(SCHED_CHARGER, charger_sm_run());
+            PROFILE_END(PROFILE_CHARGER_RUN);
+        }
+
+        if (sched_due(SCHED_RTC_SPI)) {
+            rtc_update_spi_registers();
+        }
+        if (sched_due(SCHED_RTC_TEMPERATURE)) {
+            rtc_update_temperature_compensation();
+        }
+
+        // Enter low-power mode until the earliest deadline or another interrupt.
+        // Don't enter sleep if that deadline is too close (otherwise we may miss the alarm).
+        if (sched_arm_alarm()) {
+            // Only enter sleep mode if no insomnia mask bits are set and no events are pending;
             // use recommended procedure from avr/sleep.h to avoid race conditions
-            set_sleep_mode(SLEEP_MODE_STANDBY);
             cli();
-            if (insomnia_mask == 0) {
+            if (insomnia_mask != 0) {
+                power_note_insomnia(insomnia_mask);
+            }
+            while (insomnia_mask != 0 && !(insomnia_mask & ~INSOMNIA_IDLE_OK) && !event_pending()) {
+                // Only queued TWI transactions or ADC conversions keep us awake. Wait for them in
+                // idle mode, where the peripherals keep running, unless other work comes up.
+                set_sleep_mode(SLEEP_MODE_IDLE);
+                sleep_enable();
+                power_sleep_begin(POWER_IDLE);
+                sei();
+                sleep_cpu();
+                sleep_disable();
+                cli();
+                power_sleep_end(POWER_IDLE);
+            }
+            if (insomnia_mask == 0 && !event_pending()) {
+                set_sleep_mode(SLEEP_MODE_STANDBY);
                 sleep_enable();
+                power_sleep_begin(POWER_STANDBY);
                 sei();
                 sleep_cpu();
                 sleep_disable();
+                cli();
+                power_sleep_end(POWER_STANDBY);
             }
             sei();
         }
 
-        // Tickle the watchdog. Note that we get at least one interrupt per second due to the RTC PIT.
-        // If the latter is disabled, one must make sure to set the RTC alarm at less than the watchdog timeout interval.
+        // Tickle the watchdog. This also schedules the next wakeup for it (SCHED_WATCHDOG).
         watchdog_tickle();
 
 #ifdef DEBUG_STATUS
-        static uint16_t last_bq_status = 0;
-        // Re-enable in case state machine disabled it
-        bq_enable_adc();
-        uint16_t now = rtc_get_ticks();
-        if ((now - last_bq_status) >= 1000) {
+        if (bq_adc_poll(BQ_ADC_CONSUMER_DEBUG)) {
             bq_print_status();
-
-            last_bq_status = now;
         }
 #endif
     }
@@ -140,12 +220,97 @@ int main(void) {
     return 0;
 }
 
+static void handle_events(void) {
+    Event event;
+    while (event_get(&event)) {
+        switch (event.type) {
+            case EVENT_BQ_INT:
+                bq_notify_interrupt();
+                break;
+            case EVENT_FUSB_INT:
+                // Handled by fsc_pd_run() below
+                break;
+            case EVENT_TWI_ERROR:
+                // Handled by twi_run() below
+                break;
+            case EVENT_KX2_POWER:
+                rtc_update_spi_registers();
+                charger_sm_on_kx2_power_change();
+                break;
+            case EVENT_BUTTON:
+                button_handle_press(event.data);
+                break;
+            case EVENT_RTC_OFFSET:
+                rtc_handle_offset_write(event.data);
+                break;
+            case EVENT_RTC_TIME_SET:
+                rtc_handle_time_set();
+                break;
+            case EVENT_ADC:
+                if (event.data == ADC_CHANNEL_TEMPERATURE) {
+                    rtc_handle_temperature(adc_get_temperature());
+                }
+                break;
+        }
+    }
+}
+
+static void boot_run(void) {
+    switch (boot_step) {
+        case BOOT_BQ_RESET:
+            if (sched_due(SCHED_BOOT)) {
+                if (!bq_init_finish()) {
+                    bq_init_failed();
+                }
+                if (boot_blink) {
+                    // The blink has been running in the meantime
+                    boot_step = BOOT_BLINK;
+                    sched_set(SCHED_BOOT, BOOT_BLINK_TICKS - BQ_RESET_TICKS);
+                } else {
+                    boot_finish();
+                }
+            }
+            break;
+
+        case BOOT_BLINK: {
+            ConnectionState state = fsc_pd_get_connection_state();
+            if (sched_due(SCHED_BOOT) || state == AttachedSink || state == AttachedSource) {
+                sched_cancel(SCHED_BOOT);
+                boot_finish();
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+static void boot_finish(void) {
+    // The charger state machine takes over the LED
+    led_shutdown();
+    bq_set_thermistor(sysconfig->enableThermistor);
+#ifdef DEBUG_STATUS
+    bq_adc_request(BQ_ADC_CONSUMER_DEBUG, BQ_ADC_ALL, 1000);
+#endif
+    charger_sm_init();
+    boot_step = BOOT_DONE;
+}
+
+static void bq_init_failed(void) {
+    debug_printf("BQ init failed\n");
+    led_set_blinking(true, false, false, 255, 5, 5, 3, 11);  // Red blinking, 3 x at 2 Hz with 1 second pause
+    twi_flush();
+    while (1);
+}
+
 #ifdef DEBUG_STATUS
 static void bq_print_status(void) {
-    uint16_t vbus = bq_measure_vbus();
-    int16_t ibus = bq_measure_ibus();
-    uint16_t vbat = bq_measure_vbat();
-    int16_t ibat = bq_measure_ibat();
+    const BqAdcSnapshot *adc = bq_read_adc_snapshot();
+    uint16_t vbus = adc->vbus;
+    int16_t ibus = adc->ibus;
+    uint16_t vbat = adc->vbat;
+    int16_t ibat = adc->ibat;
 
     // Calculate input/output power and efficiency without using floating point arithmetic
     int32_t pin = ((int32_t)vbus * (int32_t)ibus) / 1000;  // mW
@@ -164,7 +329,24 @@ static void bq_print_status(void) {
     debug_printf("Vbus: %u mV, Ibus: %d mA, limit: %u mV / %u mA\n", vbus, ibus, bq_get_input_voltage_limit(), bq_get_input_current_limit());
     debug_printf("Vbat: %u mV, Ibat: %d mA\n", vbat, ibat);
     debug_printf("Pin: %ld mW, Pout: %ld mW, eff = %lu.%lu%%\n", pin, pout, eff / 10, eff % 10);
-    debug_printf("BQ temperature: %d.%d C\n", bq_measure_temperature() / 2, (bq_measure_temperature() % 2) * 5);
-    debug_printf("BQ thermistor: %u\n", bq_measure_thermistor());
+    debug_printf("BQ temperature: %d.%d C\n", adc->tdie / 2, (adc->tdie % 2) * 5);
+    debug_printf("BQ thermistor: %u\n", adc->ts);
+    debug_printf("MCU VDD: %u mV\n", adc_get_vdd());
+    adc_request(ADC_CHANNEL_VDD); // For the next status output
+    debug_printf("Event max latency: %u ticks, overflows: %u\n", event_get_max_latency(), event_get_overflows());
+    debug_printf("TWI max queueing latency (bytes): FUSB %u, BQ %u, LED %u\n", twi_get_max_latency(FUSB302_I2C_ADDR),
+                 twi_get_max_latency(BQ_ADDR), twi_get_max_latency(LP5815_ADDR));
+    debug_printf("TWI errors: FUSB %u, BQ %u, LED %u, bus recoveries %u\n", twi_get_errors(FUSB302_I2C_ADDR),
+                 twi_get_errors(BQ_ADDR), twi_get_errors(LP5815_ADDR), twi_get_bus_recoveries());
+    debug_printf("TWI transactions: FUSB %lu, BQ %lu, LED %lu\n", twi_get_transactions(FUSB302_I2C_ADDR),
+                 twi_get_transactions(BQ_ADDR), twi_get_transactions(LP5815_ADDR));
+    debug_printf("TWI bytes: FUSB %lu, BQ %lu, LED %lu\n", twi_get_bytes(FUSB302_I2C_ADDR),
+                 twi_get_bytes(BQ_ADDR), twi_get_bytes(LP5815_ADDR));
+    power_print();
+    power_print_stats();
+    debug_printf("Charger: last time to full %lu s\n", charger_sm_get_time_to_full());
+#ifdef PROFILE
+    profile_print();
+#endif
 }
 #endif
@@ -6,29 +6,41 @@
 #include "rtc.h"
 #include "fsc_pd_ctl.h"
 #include "kx2.h"
+#include "event.h"
+#include "profile.h"
+#include "power.h"
 
 // Shared ISRs for pin interrupts that concern multiple modules
 
 ISR(PORTA_PORT_vect) {
+    PROFILE_BEGIN();
     if (VPORTA.INTFLAGS & PORT_INT3_bm) {
+        power_note_wake(POWER_WAKE_KX2);
         kx2_handle_interrupt();
     }
     if (VPORTA.INTFLAGS & PORT_INT4_bm) {
+        power_note_wake(POWER_WAKE_BUTTON);
         button_handle_interrupt();
     }
     if (VPORTA.INTFLAGS & PORT_INT5_bm) {
+        power_note_wake(POWER_WAKE_FUSB);
         fsc_pd_notify_interrupt();
     }
     if (VPORTA.INTFLAGS & PORT_INT6_bm) {
-        bq_notify_interrupt();
+        power_note_wake(POWER_WAKE_BQ);
+        event_post(EVENT_BQ_INT, 0);
     }
     VPORTA.INTFLAGS = 0xff;
+    PROFILE_END(PROFILE_ISR_PORTA);
 }
 
 ISR(PORTC_PORT_vect) {
+    PROFILE_BEGIN();
     if (VPORTC.INTFLAGS & PORT_INT3_bm) {
         // SPI SS went low
+        power_note_wake(POWER_WAKE_SPI_SS);
         rtc_handle_spi_ss();
     }
     VPORTC.INTFLAGS = 0xff;
+    PROFILE_END(PROFILE_ISR_PORTC);
 }
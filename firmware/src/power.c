@@ -0,0 +1,124 @@
+/*
+ * Power accounting: sleep mode residency with an estimate of the average current derived
+ * from it, as a cheap way to spot changes that add wakeups or keep the MCU awake longer, and
+ * runtime statistics on why the MCU is awake (wakeup sources, awake time per charger state,
+ * insomnia_mask bits that prevented standby).
+ *
+ * Times are measured as differences of RTC tick readings around sleep_cpu(). Single periods
+ * shorter than a tick are rounded up or down, but the sums are right on average.
+ */
+#include <string.h>
+#include <util/atomic.h>
+
+#include "power.h"
+#include "rtc.h"
+#include "debug.h"
+
+// Rough current figures for the whole board (uA). Standby is the measured figure from the
+// README; active and idle add the typical MCU supply current at 20 MHz from the datasheet.
+#define POWER_STANDBY_UA 60
+#define POWER_IDLE_UA (POWER_STANDBY_UA + 2900)
+#define POWER_ACTIVE_UA (POWER_STANDBY_UA + 7500)
+
+static const uint16_t mode_current[POWER_MODE_COUNT] = {
+    [POWER_ACTIVE] = POWER_ACTIVE_UA,
+    [POWER_IDLE] = POWER_IDLE_UA,
+    [POWER_STANDBY] = POWER_STANDBY_UA,
+};
+
+// Not cleared on startup, so that the statistics survive a warm reset (see power_init())
+PowerStats power_stats __attribute__((section(".noinit")));
+volatile bool power_woken = true;
+
+static uint32_t sleep_ticks[POWER_MODE_COUNT];
+static uint32_t period_start = 0;
+static uint16_t sleep_start;
+static uint16_t wake_time = 0;
+
+void power_init(bool warm) {
+    if (warm && power_stats.magic == POWER_STATS_MAGIC) {
+        power_stats.warm_resets++;
+        return;
+    }
+    memset(&power_stats, 0, sizeof(power_stats));
+    power_stats.magic = POWER_STATS_MAGIC;
+}
+
+void power_sleep_begin(PowerMode mode) {
+    sleep_start = rtc_get_ticks();
+    if (mode == POWER_STANDBY) {
+        power_stats.awake_ticks[charger_sm_get_state()] += (uint16_t)(sleep_start - wake_time);
+        power_woken = false;
+    }
+}
+
+void power_sleep_end(PowerMode mode) {
+    uint16_t now = rtc_get_ticks();
+    sleep_ticks[mode] += (uint16_t)(now - sleep_start);
+    if (mode == POWER_STANDBY) {
+        wake_time = now;
+        // In case the wakeup source was not one of the instrumented ISRs
+        power_woken = true;
+    }
+}
+
+void power_note_insomnia(uint8_t mask) {
+    for (uint8_t i = 0; i < POWER_INSOMNIA_BITS; i++) {
+        if (mask & (1 << i)) {
+            power_stats.insomnia[i]++;
+        }
+    }
+}
+
+void power_print(void) {
+    uint32_t ticks[POWER_MODE_COUNT];
+    uint32_t now = rtc_get_ticks32();
+    uint32_t total = now - period_start;
+    period_start = now;
+    for (uint8_t i = POWER_IDLE; i < POWER_MODE_COUNT; i++) {
+        ticks[i] = sleep_ticks[i];
+        sleep_ticks[i] = 0;
+    }
+    ticks[POWER_ACTIVE] = total - ticks[POWER_IDLE] - ticks[POWER_STANDBY];
+
+    // Residency in permille; scale down long periods so that the products don't overflow
+    while (total > 0x3FFFFF) {
+        total >>= 1;
+        for (uint8_t i = 0; i < POWER_MODE_COUNT; i++) {
+            ticks[i] >>= 1;
+        }
+    }
+    if (total == 0) {
+        return;
+    }
+    uint16_t permille[POWER_MODE_COUNT];
+    uint32_t current = 0;
+    for (uint8_t i = 0; i < POWER_MODE_COUNT; i++) {
+        permille[i] = ticks[i] * 1000 / total;
+        current += (uint32_t)permille[i] * mode_current[i];
+    }
+    debug_printf("Power: active %u.%u%%, idle %u.%u%%, standby %u.%u%%, est. %lu uA\n",
+                 permille[POWER_ACTIVE] / 10, permille[POWER_ACTIVE] % 10,
+                 permille[POWER_IDLE] / 10, permille[POWER_IDLE] % 10,
+                 permille[POWER_STANDBY] / 10, permille[POWER_STANDBY] % 10,
+                 current / 1000);
+}
+
+void power_print_stats(void) {
+    PowerStats stats;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        stats = power_stats;
+    }
+    debug_printf("Wakes: RTC CMP %lu, RTC OVF %lu, KX2 %lu, button %lu, FUSB %lu, BQ %lu, SPI SS %lu\n",
+                 stats.wakes[POWER_WAKE_RTC_CMP], stats.wakes[POWER_WAKE_RTC_OVF], stats.wakes[POWER_WAKE_KX2],
+                 stats.wakes[POWER_WAKE_BUTTON], stats.wakes[POWER_WAKE_FUSB], stats.wakes[POWER_WAKE_BQ],
+                 stats.wakes[POWER_WAKE_SPI_SS]);
+    debug_printf("Awake ticks per charger state:");
+    for (uint8_t i = 0; i < CHARGER_STATE_COUNT; i++) {
+        debug_printf(" %lu", stats.awake_ticks[i]);
+    }
+    debug_printf("\n");
+    debug_printf("Insomnia: debug TX %lu, RTC SPI %lu, ADC %lu, TWI %lu, warm resets %u\n",
+                 stats.insomnia[0], stats.insomnia[1], stats.insomnia[2], stats.insomnia[3],
+                 stats.warm_resets);
+}
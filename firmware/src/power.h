@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "charger_sm.h"
+
+typedef enum {
+    POWER_ACTIVE = 0,
+    POWER_IDLE,
+    POWER_STANDBY,
+    POWER_MODE_COUNT
+} PowerMode;
+
+// Interrupts that can end standby sleep
+typedef enum {
+    POWER_WAKE_RTC_CMP = 0,     // scheduled deadline (sched.c)
+    POWER_WAKE_RTC_OVF,         // RTC counter overflow (every 64 s)
+    POWER_WAKE_KX2,             // KX2 power pin (PA3)
+    POWER_WAKE_BUTTON,          // button (PA4)
+    POWER_WAKE_FUSB,            // FUSB_INT (PA5)
+    POWER_WAKE_BQ,              // BQ_INT (PA6)
+    POWER_WAKE_SPI_SS,          // KX2 RTC access (PC3)
+    POWER_WAKE_COUNT
+} PowerWakeSource;
+
+#define POWER_INSOMNIA_BITS 4
+#define POWER_STATS_MAGIC 0x5057
+
+// Runtime statistics in a fixed RAM block (symbol power_stats), which is kept across warm resets
+// and can be read via UPDI while the firmware is running
+typedef struct {
+    uint16_t magic;                             // POWER_STATS_MAGIC
+    uint16_t warm_resets;                       // since the last power-up
+    uint32_t wakes[POWER_WAKE_COUNT];           // wakeups from standby per source
+    uint32_t awake_ticks[CHARGER_STATE_COUNT];  // awake time between standby periods per charger state
+    uint32_t insomnia[POWER_INSOMNIA_BITS];     // insomnia_mask bits that prevented standby
+} PowerStats;
+
+extern PowerStats power_stats;
+extern volatile bool power_woken;
+
+// Initialize the statistics, unless they have been kept across a warm reset
+void power_init(bool warm);
+
+// Called with interrupts disabled right before sleep_cpu(), and right after waking up
+void power_sleep_begin(PowerMode mode);
+void power_sleep_end(PowerMode mode);
+// Called once per sleep attempt in which some insomnia_mask bits prevent standby
+void power_note_insomnia(uint8_t mask);
+
+// Called by the ISRs of the wakeup sources; only the first one after entering standby counts
+static inline void power_note_wake(PowerWakeSource source) {
+    if (!power_woken) {
+        power_woken = true;
+        power_stats.wakes[source]++;
+    }
+}
+
+// Print the residency in each mode since the last call and the resulting estimated average
+// current (= charge in uAh per hour), then start a new period
+void power_print(void);
+// Print the runtime statistics
+void power_print_stats(void);
@@ -0,0 +1,77 @@
+/*
+ * Execution time measurement of ISRs and main loop functions, enabled with -DPROFILE.
+ * TCB0 runs freely at CLK_PER / 2 in active and idle mode, so sections of up to 6.5 ms are
+ * measured with a resolution of 2 CPU cycles. The overhead is a few cycles per section, and
+ * the ISR prologue and epilogue are not included. Worst-case interrupt latency is bounded by the
+ * longest ISR plus the longest PROFILE_IRQOFF_* section.
+ *
+ * Peripherals used: TCB0.
+ */
+#ifdef PROFILE
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include "profile.h"
+#include "debug.h"
+
+// Cycles per TCB0 count
+#define PROFILE_PRESCALER 2
+
+typedef struct {
+    uint32_t total;
+    uint16_t count;
+    uint16_t max;
+} ProfileStats;
+
+static ProfileStats stats[PROFILE_COUNT];
+
+static const char *const names[PROFILE_COUNT] = {
+    [PROFILE_ISR_SPI0] = "SPI0 ISR",
+    [PROFILE_ISR_PORTA] = "PORTA ISR",
+    [PROFILE_ISR_PORTC] = "PORTC ISR",
+    [PROFILE_ISR_RTC] = "RTC ISR",
+    [PROFILE_ISR_TWI] = "TWI ISR",
+    [PROFILE_PD_RUN] = "fsc_pd_run",
+    [PROFILE_CHARGER_RUN] = "charger_sm_run",
+    [PROFILE_IRQOFF_TWI] = "TWI interrupts off",
+    [PROFILE_IRQOFF_RTC] = "RTC interrupts off",
+};
+
+void profile_init(void) {
+    // Periodic interrupt mode with the full 16-bit period (no interrupt enabled)
+    TCB0.CCMP = 0xFFFF;
+    TCB0.CTRLB = TCB_CNTMODE_INT_gc;
+    TCB0.CTRLA = TCB_CLKSEL_DIV2_gc | TCB_ENABLE_bm;
+}
+
+void profile_record(ProfileId id, uint16_t counts) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ProfileStats *s = &stats[id];
+        if (s->count == UINT16_MAX) {
+            // Keep the average meaningful
+            s->total /= 2;
+            s->count /= 2;
+        }
+        s->total += counts;
+        s->count++;
+        if (counts > s->max) {
+            s->max = counts;
+        }
+    }
+}
+
+void profile_print(void) {
+    for (uint8_t i = 0; i < PROFILE_COUNT; i++) {
+        ProfileStats s;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            s = stats[i];
+            stats[i] = (ProfileStats){0};
+        }
+        if (s.count == 0) {
+            continue;
+        }
+        debug_printf("Profile %s: %u x, avg %lu, max %lu cycles\n", names[i], s.count,
+                     s.total / s.count * PROFILE_PRESCALER, (uint32_t)s.max * PROFILE_PRESCALER);
+    }
+}
+#endif
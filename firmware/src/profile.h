@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+// Execution time measurement (PROFILE builds only). Wrap a code section in PROFILE_BEGIN() and
+// PROFILE_END(id) within the same block; without PROFILE, both expand to nothing.
+// The PROFILE_IRQOFF_* sections are placed inside ATOMIC_BLOCKs to measure how long the module
+// keeps interrupts disabled.
+typedef enum {
+    PROFILE_ISR_SPI0 = 0,       // RTC register reads/writes by the KX2
+    PROFILE_ISR_PORTA,          // KX2 power, button, FUSB_INT, BQ_INT
+    PROFILE_ISR_PORTC,          // SPI SS
+    PROFILE_ISR_RTC,            // compare alarm and overflow
+    PROFILE_ISR_TWI,            // TWI master state machine
+    PROFILE_PD_RUN,             // fsc_pd_run()
+    PROFILE_CHARGER_RUN,        // charger_sm_run()
+    PROFILE_IRQOFF_TWI,         // twi.c queue updates
+    PROFILE_IRQOFF_RTC,         // rtc.c counter reads and wall-clock updates
+    PROFILE_COUNT
+} ProfileId;
+
+#ifdef PROFILE
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#define PROFILE_BEGIN() uint16_t profile_start = profile_now()
+#define PROFILE_END(id) profile_record((id), profile_now() - profile_start)
+
+// Disable interrupts to read 16-bit register to prevent TEMP clobbering
+static inline uint16_t profile_now(void) {
+    uint16_t count;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        count = TCB0.CNT;
+    }
+    return count;
+}
+
+void profile_init(void);
+void profile_record(ProfileId id, uint16_t counts);
+// Print the average and worst-case CPU cycles of each section, and reset the statistics
+void profile_print(void);
+#else
+#define PROFILE_BEGIN()
+#define PROFILE_END(id)
+#endif
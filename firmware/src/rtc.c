@@ -4,6 +4,7 @@
  * used by the Elecraft KX2.
  *
  * Peripherals used: RTC, SPI0 (on alternate pins PC0-PC3), PORTC interrupt.
+ * The chip temperature for crystal compensation is measured via the ADC service (adc.c).
  */
 #include <avr/common.h>
 #include <avr/io.h>
@@ -18,22 +19,70 @@
 #include "debug.h"
 #include "insomnia.h"
 #include "userrow.h"
+#include "event.h"
+#include "sched.h"
+#include "kx2.h"
+#include "adc.h"
+#include "profile.h"
+#include "rtc_calib.h"
+#include "power.h"
+
+// Interval of RTC temperature compensation updates
+#define RTC_TEMPERATURE_INTERVAL_TICKS (60 * 1024UL)
+
+// Drift learning: time corrections by more than this are considered to be setting the time
+// (e.g. after power up or for a different time zone) rather than correcting drift
+#define RTC_LEARN_MAX_CORRECTION 300        // s
+// Minimum time over which corrections are accumulated before estimating the drift, as the
+// user can only set the time to within about a second
+#define RTC_LEARN_MIN_INTERVAL (2 * 86400UL) // s
+#define RTC_LEARN_MAX_OFFSET (32 * 256)     // 1/256 ppm
 
 static volatile uint8_t nextRegister = 0;
 static volatile bool write = false;
 
-// We use the RTC peripheral to keep a running count of ticks (at 1024 Hz) in RTC.CNT,
-// and also use its periodic interrupt timer (PIT) to increment our wall-clock timekeeping.
-static volatile uint8_t hours = 0;
-static volatile uint8_t minutes = 0;
-static volatile uint8_t seconds = 0;
-
-// Offset applied by temperature compensation 
-static volatile int16_t temperature_offset_ppm = 0;
+// Packed BCD image of the seconds, minutes and hours registers (0x02..0x04), so that the
+// SPI ISR only has to copy bytes. Only accessed with interrupts disabled.
+static uint8_t time_registers[3];
+
+// We use the RTC peripheral to keep a running count of ticks (at 1024 Hz) in RTC.CNT.
+// The wall-clock time is only brought up to date from the tick count when somebody asks
+// for it (see rtc_update_wall_clock()), so there is no need to wake up every second.
+// Only accessed with interrupts disabled.
+static uint8_t hours = 0;
+static uint8_t minutes = 0;
+static uint8_t seconds = 0;
+// Tick count at which the wall-clock time above was valid
+static uint32_t wall_clock_ticks = 0;
+// Seconds since startup, advanced along with the wall-clock time (does not wrap in practice)
+static uint32_t uptime_seconds = 0;
+
+// Time correction made by the KX2 (in s), while the time registers are being written
+// (time_before_write) and for rtc_handle_time_set() (time_correction*)
+static int32_t time_before_write;
+static bool time_written = false;
+static volatile int32_t time_correction;
+static volatile uint32_t time_correction_uptime;
+// Corrections accumulated since the reference point for drift learning (main loop only)
+static bool learn_reference_valid = false;
+static uint32_t learn_reference_uptime;
+static int16_t learn_correction_sum;
+
+// Upper 16 bits of the 32-bit tick count, incremented on every RTC.CNT overflow (every 64 s)
+static volatile uint16_t ticks_high = 0;
+// Full 32-bit time of the pending alarm, which may be several counter wraps away
+static volatile uint32_t alarm_ticks = 0;
+
+// Offset applied by temperature compensation, in 1/256 ppm
+static int16_t temperature_offset_q8 = 0;
+// Accumulated fraction (1/256 ppm) for dithering RTC.CALIB between adjacent values
+static uint8_t calib_dither = 0;
 
 static void spi_init(void);
-static void rtc_measure_temperature_offset(void);
 static void rtc_update_calib(void);
+static void rtc_update_wall_clock(void);
+static void rtc_spi_preload(void);
+static int32_t rtc_seconds_of_day(void);
 
 void rtc_init(void) {
     spi_init();
@@ -45,43 +94,119 @@ void rtc_init(void) {
     RTC.CLKSEL = RTC_CLKSEL_TOSC32K_gc;
     while (RTC.STATUS & RTC_CTRLABUSY_bm); // Wait for sync
     RTC.CTRLA = RTC_RUNSTDBY_bm | RTC_PRESCALER_DIV32_gc | RTC_RTCEN_bm;
+    RTC.INTCTRL = RTC_OVF_bm;
 
-    rtc_measure_temperature_offset();
+    rtc_update_calib();
+    rtc_update_temperature_compensation();
 
-    // Configure PIT for one second interrupts
+#ifdef RTC_CALIBRATION_MODE
+    // Enable PIT (without interrupt) for its event outputs
     while (RTC.PITSTATUS & RTC_CTRLBUSY_bm); // Wait for sync
     RTC.PITCTRLA = RTC_PERIOD_CYC32768_gc | RTC_PITEN_bm;
-    RTC.PITINTCTRL |= RTC_PI_bm;
 
-#ifdef RTC_CALIBRATION_MODE
     // Output 32.768 kHz /64 = 512 Hz clock on PA2 for measuring
     PORTA.DIRSET = PIN2_bm;
     EVSYS.CHANNEL1 = EVSYS_CHANNEL1_RTC_PIT_DIV64_gc;
     EVSYS.USEREVSYSEVOUTA = EVSYS_USER_CHANNEL1_gc;
 #endif
+
+    rtc_update_spi_registers();
 }
 
 void rtc_get_time(uint8_t *phours, uint8_t *pminutes, uint8_t *pseconds) {
-    *phours = hours;
-    *pminutes = minutes;
-    *pseconds = seconds;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        PROFILE_BEGIN();
+        rtc_update_wall_clock();
+        *phours = hours;
+        *pminutes = minutes;
+        *pseconds = seconds;
+        PROFILE_END(PROFILE_IRQOFF_RTC);
+    }
+}
+
+// Advance the wall-clock time by the whole seconds elapsed since it was last updated.
+// Must be called with interrupts disabled.
+static void rtc_update_wall_clock(void) {
+    uint32_t elapsed = (rtc_get_ticks32() - wall_clock_ticks) >> 10;
+    if (elapsed == 0) {
+        return;
+    }
+    // Keep the sub-second phase
+    wall_clock_ticks += elapsed << 10;
+    uptime_seconds += elapsed;
+
+    if (elapsed < 60) {
+        // Usual case: the time is queried regularly (at least by temperature compensation),
+        // so avoid 32-bit divisions, as this also runs at the start of SPI transfers
+        seconds += elapsed;
+        if (seconds < 60) {
+            return;
+        }
+        seconds -= 60;
+        if (++minutes < 60) {
+            return;
+        }
+        minutes = 0;
+        if (++hours >= 24) {
+            hours = 0;
+        }
+        return;
+    }
+
+    uint32_t time_of_day = ((uint32_t)hours * 3600 + minutes * 60 + seconds + elapsed) % 86400UL;
+    hours = time_of_day / 3600;
+    uint16_t rem = time_of_day % 3600;
+    minutes = rem / 60;
+    seconds = rem % 60;
 }
 
 uint16_t rtc_get_ticks(void) {
     uint16_t count;
     // Disable interrupts to read 16-bit register to prevent TEMP clobbering
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        PROFILE_BEGIN();
         while (RTC.STATUS & RTC_CNTBUSY_bm); // Wait for sync
         count = RTC.CNT;
+        PROFILE_END(PROFILE_IRQOFF_RTC);
     }
     return count;
 }
 
-void rtc_set_alarm(uint16_t ticks) {
+uint32_t rtc_get_ticks32(void) {
+    uint16_t low;
+    uint16_t high;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        PROFILE_BEGIN();
+        while (RTC.STATUS & RTC_CNTBUSY_bm); // Wait for sync
+        low = RTC.CNT;
+        high = ticks_high;
+        if (RTC.INTFLAGS & RTC_OVF_bm) {
+            // The counter has wrapped, but the overflow interrupt hasn't been serviced yet.
+            // Read again, as we don't know whether low was read before or after the wrap.
+            low = RTC.CNT;
+            high++;
+        }
+        PROFILE_END(PROFILE_IRQOFF_RTC);
+    }
+    return ((uint32_t)high << 16) | low;
+}
+
+bool rtc_set_alarm_at(uint32_t ticks) {
     while (RTC.STATUS & RTC_CMPBUSY_bm); // Wait for sync
-    RTC.CMP = rtc_get_ticks() + ticks;
-    RTC.INTFLAGS |= RTC_CMP_bm; // Clear any pending interrupt flag
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        alarm_ticks = ticks;
+        RTC.CMP = (uint16_t)ticks;
+    }
+    RTC.INTFLAGS = RTC_CMP_bm; // Clear any pending interrupt flag
     RTC.INTCTRL |= RTC_CMP_bm;
+
+    // Make sure the counter hasn't already passed the alarm while it was being synchronized
+    while (RTC.STATUS & RTC_CMPBUSY_bm);
+    return (int32_t)(ticks - rtc_get_ticks32()) > 0;
+}
+
+void rtc_cancel_alarm(void) {
+    RTC.INTCTRL &= ~RTC_CMP_bm;
 }
 
 static void spi_init(void) {
@@ -93,25 +218,78 @@ static void spi_init(void) {
 
     // Switch to alternate SPI0 pins (PC0-PC3)
     PORTMUX.SPIROUTEA |= PORTMUX_SPI0_ALT1_gc;
-    SPI0.INTCTRL |= SPI_IE_bm; // Enable SPI interrupt
+
+    // Buffered mode, so that the response to the command byte can be queued before the
+    // transfer starts (see rtc_spi_load()). BUFWR = 0: a dummy byte is sent first.
+    SPI0.CTRLB = SPI_BUFEN_bm;
+    SPI0.INTCTRL = SPI_RXCIE_bm; // Enable SPI receive complete interrupt
     SPI0.CTRLA |= SPI_ENABLE_bm;
 }
 
-static void rtc_measure_temperature_offset(void) {
-#ifdef RTC_TEMPERATURE_COMPENSATION
-     // Measure temperature and adjust RTC.CALIB accordingly
-
-    // From Abracon ABS06 crystal datasheet:
-    // - temperature coefficient: -0.03 ppm/T^2,
-    // - turnover temperature: +25 °C
-    int16_t temp_diff = measure_chip_temperature() - 25;
-    int16_t offset_x100 = -3 * temp_diff * temp_diff;
-    temperature_offset_ppm = (offset_x100 + (offset_x100 >= 0 ? 50 : -50)) / 100;
-#endif
+// Install the register image and queue the seconds register, which the KX2 reads first,
+// for the next transfer. It is shifted out right after the command byte without any help
+// from the CPU, which may still be waking up from standby at that point.
+// Must be called with interrupts disabled.
+static void rtc_spi_load(const uint8_t *image) {
+    time_registers[0] = image[0];
+    time_registers[1] = image[1];
+    time_registers[2] = image[2];
+
+    // SS may have gone low with the PORTC interrupt still pending; the transfer has then
+    // already started with the previously queued byte, which must not be flushed.
+    if (!(PORTC.IN & PIN3_bm)) {
+        return;
+    }
+    // Re-enabling the SPI flushes any bytes still queued in the transmit buffer
+    SPI0.CTRLA &= ~SPI_ENABLE_bm;
+    SPI0.CTRLA |= SPI_ENABLE_bm;
+    SPI0.DATA = time_registers[0];
+}
 
-    rtc_update_calib();
+// As rtc_spi_load(), with the image taken from the current wall clock.
+// Must be called with interrupts disabled and SS not asserted.
+static void rtc_spi_preload(void) {
+    rtc_update_wall_clock();
+    uint8_t image[3] = { decimalToBcd(seconds), decimalToBcd(minutes), decimalToBcd(hours) };
+    rtc_spi_load(image);
 }
 
+void rtc_update_spi_registers(void) {
+    if (!kx2_is_on()) {
+        // Nobody will read the registers, so no need to wake up every second
+        sched_cancel(SCHED_RTC_SPI);
+        return;
+    }
+
+    uint8_t image[3];
+    uint16_t next_second;
+    uint8_t s, m, h;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        rtc_update_wall_clock();
+        s = seconds;
+        m = minutes;
+        h = hours;
+        next_second = 1024 - (uint16_t)(rtc_get_ticks32() - wall_clock_ticks);
+    }
+    // This runs right after a second boundary, so the image can't go stale before it is loaded
+    image[0] = decimalToBcd(s);
+    image[1] = decimalToBcd(m);
+    image[2] = decimalToBcd(h);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        PROFILE_BEGIN();
+        // Not while a transfer is ongoing; this will be done at its end (SS high). The pin is
+        // checked as well, as SS may have gone low with the PORTC interrupt still pending.
+        if (!(insomnia_mask & INSOMNIA_RTC_SPI) && (PORTC.IN & PIN3_bm)) {
+            rtc_spi_load(image);
+        }
+        PROFILE_END(PROFILE_IRQOFF_RTC);
+    }
+    sched_set(SCHED_RTC_SPI, next_second);
+}
+
+// Called at least once per temperature compensation interval, as the fraction of a ppm in the
+// total offset is dithered (see rtc_calib_dither())
 static void rtc_update_calib(void) {
     int8_t factory_offset = 0;
     if (userrow_valid()) {
@@ -119,20 +297,16 @@ static void rtc_update_calib(void) {
     }
 #ifdef RTC_CALIBRATION_MODE
     // Ignore temperature compensation and user offset in RTC calibration mode
-    int16_t total_offset = factory_offset;
+    int32_t total_offset_q8 = factory_offset * 256L;
 #else
-    int16_t total_offset = sysconfig->userRtcOffset + factory_offset + temperature_offset_ppm;
+    int32_t total_offset_q8 = (sysconfig->userRtcOffset + factory_offset) * 256L + sysconfig->learnedRtcOffset
+                              + temperature_offset_q8;
 #endif
 
-    // Clamp to RTC.CALIB range of -127 to 127
-    if (total_offset < -127) {
-        total_offset = -127;
-    } else if (total_offset > 127) {
-        total_offset = 127;
-    }
+    int8_t total_offset = rtc_calib_dither(total_offset_q8, &calib_dither);
 
-    debug_printf("RTC calibration update: user %d ppm, factory %d ppm, temp %d ppm => total %d ppm\n",
-                 sysconfig->userRtcOffset, factory_offset, temperature_offset_ppm, total_offset);
+    debug_printf("RTC calibration update: user %d ppm, factory %d ppm, learned %d/256 ppm, temp %d/256 ppm => total %d ppm\n",
+                 sysconfig->userRtcOffset, factory_offset, sysconfig->learnedRtcOffset, temperature_offset_q8, total_offset);
 
     // CALIB does not use two's complement, but a sign bit + magnitude
     if (total_offset < 0) {
@@ -144,57 +318,175 @@ static void rtc_update_calib(void) {
     RTC.CTRLA |= RTC_CORREN_bm; // Enable correction
 }
 
+void rtc_update_temperature_compensation(void) {
+    // Also keeps the elapsed time small for the next wall-clock update
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        PROFILE_BEGIN();
+        rtc_update_wall_clock();
+        PROFILE_END(PROFILE_IRQOFF_RTC);
+    }
+#ifdef RTC_TEMPERATURE_COMPENSATION
+    // The result is passed to rtc_handle_temperature() via EVENT_ADC
+    adc_request(ADC_CHANNEL_TEMPERATURE);
+#endif
+    sched_set(SCHED_RTC_TEMPERATURE, RTC_TEMPERATURE_INTERVAL_TICKS);
+}
+
+void rtc_handle_temperature(int16_t temperature) {
+#ifdef RTC_TEMPERATURE_COMPENSATION
+    // Adjust RTC.CALIB according to the measured temperature
+    temperature_offset_q8 = rtc_calib_temperature_offset_q8(temperature);
+
+    rtc_update_calib();
+#endif
+}
+
+void rtc_handle_offset_write(uint8_t value) {
+    int8_t offset = value & 0x7F; // Assume KX2 always uses course mode
+    if (offset & 0x40) {
+        offset |= 0x80; // Sign extend negative value
+    }
+
+    // The offset is given in units of 4.34 ppm (see PCF2123 datasheet, page 29).
+    int16_t newUserRtcOffset = ((int16_t)offset * 434) / 100;
+
+    // Store the offset in our EEPROM. The KX2 will store it on its own as well, but
+    // will not send it back to us on its own - only when the user goes back into the
+    // RTC ADJ menu and changes it.
+    sysconfig_update_word(&sysconfig->userRtcOffset, newUserRtcOffset);
+
+    // Corrections made so far were made with a different offset
+    learn_reference_valid = false;
+
+    rtc_update_calib();
+}
+
+// Estimate the remaining drift from the time corrections that the user makes on the KX2,
+// and fold it into the learned offset
+void rtc_handle_time_set(void) {
+    int32_t correction;
+    uint32_t uptime;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        correction = time_correction;
+        uptime = time_correction_uptime;
+    }
+    if (correction == 0) {
+        // Time written back unchanged, nothing to learn
+        return;
+    }
+    debug_printf("RTC time corrected by %ld s\n", correction);
+
+    if (!learn_reference_valid || correction > RTC_LEARN_MAX_CORRECTION || correction < -RTC_LEARN_MAX_CORRECTION) {
+        // Time has been set, start measuring from here
+        learn_reference_valid = true;
+        learn_reference_uptime = uptime;
+        learn_correction_sum = 0;
+        return;
+    }
+
+    learn_correction_sum += correction;
+    uint32_t interval = uptime - learn_reference_uptime;
+    if (learn_correction_sum > RTC_LEARN_MAX_CORRECTION || learn_correction_sum < -RTC_LEARN_MAX_CORRECTION) {
+        // Implausible for drift; start over
+        learn_reference_uptime = uptime;
+        learn_correction_sum = 0;
+        return;
+    }
+    if (interval < RTC_LEARN_MIN_INTERVAL) {
+        return;
+    }
+
+    // Our clock running fast means the user sets it back, which requires a positive offset.
+    // Only apply half of the estimate to smooth out the imprecision of manual corrections.
+    int32_t drift_q8 = -(int32_t)learn_correction_sum * 1000000L / (int32_t)(interval >> 8);
+    int32_t learned = sysconfig->learnedRtcOffset + drift_q8 / 2;
+    if (learned > RTC_LEARN_MAX_OFFSET) {
+        learned = RTC_LEARN_MAX_OFFSET;
+    } else if (learned < -RTC_LEARN_MAX_OFFSET) {
+        learned = -RTC_LEARN_MAX_OFFSET;
+    }
+    debug_printf("RTC drift %ld/256 ppm over %lu s, learned offset %ld/256 ppm\n", drift_q8, interval, learned);
+    sysconfig_update_word(&sysconfig->learnedRtcOffset, learned);
+
+    learn_reference_uptime = uptime;
+    learn_correction_sum = 0;
+
+    rtc_update_calib();
+}
+
+// Current wall-clock time in seconds since midnight. Must be called with interrupts disabled.
+static int32_t rtc_seconds_of_day(void) {
+    return (int32_t)hours * 3600 + minutes * 60 + seconds;
+}
+
 void rtc_handle_spi_ss(void) {
     // Note: this is called from an interrupt context
     if (PORTC.IN & PIN3_bm) {
         // SS went high
         insomnia_mask &= ~INSOMNIA_RTC_SPI;
+
+        if (time_written) {
+            // Let the main loop learn from the correction the user has made
+            time_written = false;
+            int32_t correction = rtc_seconds_of_day() - time_before_write;
+            if (correction > 43200) {
+                correction -= 86400;
+            } else if (correction < -43200) {
+                correction += 86400;
+            }
+            time_correction = correction;
+            time_correction_uptime = uptime_seconds;
+            event_post(EVENT_RTC_TIME_SET, 0);
+        }
+
+        // Get ready for the next transfer (this also picks up any time written by the KX2)
+        rtc_spi_preload();
     } else {
         // SS went low
         insomnia_mask |= INSOMNIA_RTC_SPI;
 
-        // Reset state
+        // Reset state. The first response byte has already been queued.
         nextRegister = 0;
         write = false;
-        SPI0.DATA = 0x00; // Dummy byte
     }
 }
 
-ISR(RTC_PIT_vect) {
-    RTC.PITINTFLAGS |= RTC_PI_bm; // Clear interrupt flag
-
-    // This interrupt occurs every second
-    seconds++;
-    if (seconds >= 60) {
-        seconds = 0;
-        minutes++;
-        if (minutes >= 60) {
-            minutes = 0;
-            hours++;
-            if (hours >= 24) {
-                hours = 0;
-            }
+ISR(RTC_CNT_vect) {
+    PROFILE_BEGIN();
+    if (RTC.INTFLAGS & RTC_CMP_bm) {
+        RTC.INTFLAGS = RTC_CMP_bm; // Clear interrupt flag
+        power_note_wake(POWER_WAKE_RTC_CMP);
+        // The compare match occurs on every counter wrap; only the last one is the actual alarm
+        if ((int32_t)(alarm_ticks - rtc_get_ticks32()) <= 0) {
+            // Alarm occurred
+            // Disable further interrupts
+            RTC.INTCTRL &= ~RTC_CMP_bm;
         }
-        rtc_measure_temperature_offset();
     }
+    if (RTC.INTFLAGS & RTC_OVF_bm) {
+        RTC.INTFLAGS = RTC_OVF_bm; // Clear interrupt flag
+        power_note_wake(POWER_WAKE_RTC_OVF);
+        ticks_high++;
+    }
+    PROFILE_END(PROFILE_ISR_RTC);
 }
 
-ISR(RTC_CNT_vect) {
-    if (RTC.INTFLAGS & RTC_CMP_bm) {
-        RTC.INTFLAGS |= RTC_CMP_bm; // Clear interrupt flag
-        // Alarm occurred
-        // Disable further interrupts
-        RTC.INTCTRL &= ~RTC_CMP_bm;
+// Value of a register as sent to the KX2
+static uint8_t spi_read_register(uint8_t reg) {
+    if (reg >= 0x02 && reg <= 0x04) {
+        return time_registers[reg - 0x02];
     }
+    return 0x00;
 }
 
-ISR(SPI0_INT_vect) {
-    if (!(SPI0.INTFLAGS & SPI_IF_bm)) {
+static inline void spi_service(void) {
+    if (!(SPI0.INTFLAGS & SPI_RXCIF_bm)) {
         return; // No interrupt flag
     }
 
     uint8_t readData = SPI0.DATA;
 
+    // In buffered mode, the byte queued here is sent after the one currently being shifted out
     if (nextRegister == 0) {
         // First byte is command byte
         if (readData & 0x80) {
@@ -206,50 +498,44 @@ ISR(SPI0_INT_vect) {
         }
         nextRegister = readData & 0x0F;
         if (write) {
+            // Make sure we don't lose any elapsed time when the KX2 sets some of the fields
+            rtc_update_wall_clock();
+            if (!time_written) {
+                time_before_write = rtc_seconds_of_day();
+            }
             SPI0.DATA = 0x00; // Dummy byte for write
             return;
         }
+        // The preloaded seconds register is being sent now. The KX2 always starts reading
+        // there; any other register would get the seconds as its first byte.
+        nextRegister++;
     }
 
     if (write) {
         // Write operation
         if (nextRegister == 0x02) {
             seconds = bcdToDecimal(readData);
+            time_written = true;
         } else if (nextRegister == 0x03) {
             minutes = bcdToDecimal(readData);
+            time_written = true;
         } else if (nextRegister == 0x04) {
             hours = bcdToDecimal(readData);
+            time_written = true;
         } else if (nextRegister == 0x0d) {
-            int8_t offset = readData & 0x7F; // Assume KX2 always uses course mode
-            if (offset & 0x40) {
-                offset |= 0x80; // Sign extend negative value
-            }
-
-            // The offset is given in units of 4.34 ppm (see PCF2123 datasheet, page 29).
-            int16_t newUserRtcOffset = ((int16_t)offset * 434) / 100;
-
-            // Store the offset in our EEPROM. The KX2 will store it on its own as well, but
-            // will not send it back to us on its own - only when the user goes back into the
-            // RTC ADJ menu and changes it.
-            sysconfig_update_word(&sysconfig->userRtcOffset, newUserRtcOffset);
-
-            rtc_update_calib();
+            // Storing the offset involves an EEPROM write, so leave it to the main loop
+            event_post(EVENT_RTC_OFFSET, readData);
         }
         SPI0.DATA = 0x00;
     } else {
-        // Read operation
-        if (nextRegister == 0x02) {
-            // Read seconds
-            SPI0.DATA = decimalToBcd(seconds);
-        } else if (nextRegister == 0x03) {
-            // Read minutes
-            SPI0.DATA = decimalToBcd(minutes);
-        } else if (nextRegister == 0x04) {
-            // Read hours
-            SPI0.DATA = decimalToBcd(hours);
-        } else {
-            SPI0.DATA = 0x00;
-        }
+        // Read operation: queue the next register
+        SPI0.DATA = spi_read_register(nextRegister);
     }
     nextRegister++;
-}
\ No newline at end of file
+}
+
+ISR(SPI0_INT_vect) {
+    PROFILE_BEGIN();
+    spi_service();
+    PROFILE_END(PROFILE_ISR_SPI0);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
 void rtc_init(void);
 void rtc_get_time(uint8_t *hours, uint8_t *minutes, uint8_t *seconds);
@@ -10,9 +11,27 @@ void rtc_get_time_ms(uint8_t *phours, uint8_t *pminutes, uint8_t *pseconds, uint
 // to a rolling millisecond value and can be used in cases where the difference between
 // 1000 or 1024 ms to a second is not important or can be compensated.
 uint16_t rtc_get_ticks(void);
+// Same, extended to 32 bits by counting overflows (wraps after about 48 days).
+// Use this for time differences that may exceed 64 seconds.
+uint32_t rtc_get_ticks32(void);
 
-// Set an alarm to trigger an interrupt in a specified number of ticks.
-// This can be used to wake up the system from low-power mode.
-void rtc_set_alarm(uint16_t ticks);
+// Set an alarm to trigger an interrupt at the specified time (as returned by rtc_get_ticks32()).
+// This can be used to wake up the system from low-power mode. Returns false if the
+// counter has already passed the alarm time by the time it has taken effect.
+// Normally only used via the timer service (sched.h), which owns the alarm.
+bool rtc_set_alarm_at(uint32_t ticks);
+void rtc_cancel_alarm(void);
 
 void rtc_handle_spi_ss(void);
+
+// Called from the main loop when SCHED_RTC_SPI is due and when the KX2 power state changes.
+// Keeps the time registers up to date for the KX2 (once per second while it is on).
+void rtc_update_spi_registers(void);
+// Called from the main loop when SCHED_RTC_TEMPERATURE is due
+void rtc_update_temperature_compensation(void);
+// Called from the main loop for EVENT_ADC with the measured chip temperature (°C)
+void rtc_handle_temperature(int16_t temperature);
+// Called from the main loop for EVENT_RTC_OFFSET
+void rtc_handle_offset_write(uint8_t value);
+// Called from the main loop for EVENT_RTC_TIME_SET
+void rtc_handle_time_set(void);
@@ -0,0 +1,32 @@
+#include "rtc_calib.h"
+
+int16_t rtc_calib_temperature_offset_q8(int16_t temperature) {
+    // From Abracon ABS06 crystal datasheet:
+    // - temperature coefficient: -0.03 ppm/T^2,
+    // - turnover temperature: +25 °C
+    int16_t temp_diff = temperature - 25;
+    int32_t offset_x100 = -3L * temp_diff * temp_diff;
+    // Keep the fraction (in 1/256 ppm, rounded)
+    int32_t offset_q8 = (offset_x100 * 256 - 50) / 100;
+    if (offset_q8 < INT16_MIN) {
+        offset_q8 = INT16_MIN;
+    }
+    return offset_q8;
+}
+
+int8_t rtc_calib_dither(int32_t total_offset_q8, uint8_t *dither) {
+    if (total_offset_q8 < -127 * 256) {
+        total_offset_q8 = -127 * 256;
+    } else if (total_offset_q8 > 127 * 256) {
+        total_offset_q8 = 127 * 256;
+    }
+
+    // Round down, and round up whenever the accumulated fraction reaches 1 ppm
+    int16_t total_offset = total_offset_q8 >> 8;
+    uint16_t sum = *dither + (total_offset_q8 & 0xFF);
+    if (sum >= 256) {
+        total_offset++;
+    }
+    *dither = sum;
+    return total_offset;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+// RTC frequency correction arithmetic, kept free of hardware access so that it can be
+// checked on the host (see test/test_rtc_calib.c). Offsets are in ppm, q8 = 1/256 ppm.
+
+// Frequency offset of the crystal at the given temperature (°C), as a correction to apply
+int16_t rtc_calib_temperature_offset_q8(int16_t temperature);
+
+// Clamp the total offset to the RTC.CALIB range (-127..127 ppm) and return the whole ppm value
+// to apply for the next interval. RTC.CALIB only has a resolution of 1 ppm, so the fraction is
+// applied by switching between the adjacent values, such that the average over time matches
+// (first order sigma-delta). dither holds the accumulated fraction between calls.
+int8_t rtc_calib_dither(int32_t total_offset_q8, uint8_t *dither);
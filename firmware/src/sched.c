@@ -0,0 +1,62 @@
+/*
+ * Tickless timer service: collects the deadlines of all modules and programs the RTC
+ * compare alarm for the earliest one, so that the MCU neither wakes up for nothing
+ * nor sleeps through a deadline.
+ */
+#include "sched.h"
+#include "rtc.h"
+
+// Don't go to sleep if the next deadline is closer than this. Writing RTC.CMP takes a few
+// RTC clock cycles to synchronize, and the counter must not pass it in the meantime.
+#define SCHED_GUARD_TICKS 2
+
+static uint32_t deadlines[SCHED_COUNT];
+static uint8_t active_mask = 0;
+
+void sched_set(SchedId id, uint32_t ticks) {
+    if (ticks == 0) {
+        sched_cancel(id);
+        return;
+    }
+    deadlines[id] = rtc_get_ticks32() + ticks;
+    active_mask |= 1 << id;
+}
+
+void sched_cancel(SchedId id) {
+    active_mask &= ~(1 << id);
+}
+
+bool sched_due(SchedId id) {
+    if (!(active_mask & (1 << id))) {
+        return false;
+    }
+    if ((int32_t)(deadlines[id] - rtc_get_ticks32()) > 0) {
+        return false;
+    }
+    active_mask &= ~(1 << id);
+    return true;
+}
+
+bool sched_arm_alarm(void) {
+    if (active_mask == 0) {
+        rtc_cancel_alarm();
+        return true;
+    }
+
+    // Find the earliest deadline
+    uint32_t now = rtc_get_ticks32();
+    int32_t earliest = INT32_MAX;
+    for (uint8_t i = 0; i < SCHED_COUNT; i++) {
+        if (active_mask & (1 << i)) {
+            int32_t remaining = deadlines[i] - now;
+            if (remaining < earliest) {
+                earliest = remaining;
+            }
+        }
+    }
+
+    if (earliest < SCHED_GUARD_TICKS) {
+        return false;
+    }
+    return rtc_set_alarm_at(now + earliest);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Deadlines of all modules that need to wake up the MCU at a certain time
+typedef enum {
+    SCHED_PD = 0,               // FSC PD core timers (core_get_next_timeout())
+    SCHED_CHARGER,              // Charger state machine timer
+    SCHED_BQ_ADC,               // BQ ADC conversions
+    SCHED_RTC_TEMPERATURE,      // RTC temperature compensation
+    SCHED_RTC_SPI,              // RTC SPI register image refresh (while the KX2 is on)
+    SCHED_WATCHDOG,             // Periodic wakeup to service the watchdog
+    SCHED_BOOT,                 // Startup steps (BQ register reset, power-up blink)
+    SCHED_COUNT
+} SchedId;
+
+// Set a deadline in the given number of ticks from now (0 = cancel)
+void sched_set(SchedId id, uint32_t ticks);
+void sched_cancel(SchedId id);
+// Returns true (once) if the deadline has passed
+bool sched_due(SchedId id);
+
+// Program the RTC alarm for the earliest deadline. Returns false if that deadline is so close
+// that going to sleep would risk missing it (the caller should run the main loop again instead).
+bool sched_arm_alarm(void);
@@ -16,7 +16,8 @@ volatile EEMEM struct SysConfig sysconfig_eeprom = {
     .otgVoltageHeadroom = 100,
     .chargeWhenRigIsOn = false,
     .enableThermistor = false,
-    .userRtcOffset = 0
+    .userRtcOffset = 0,
+    .learnedRtcOffset = 0
 };
 
 // Memory-mapped pointer to sysconfig in EEPROM
@@ -32,6 +32,7 @@ struct SysConfig {
     bool chargeWhenRigIsOn;
     bool enableThermistor;
     int16_t userRtcOffset;            // user RTC offset in ppm, set via KX2 RTC ADJ menu (-278 to +273)
+    int16_t learnedRtcOffset;         // RTC offset in 1/256 ppm, learned from KX2 time corrections
 };
 
 extern struct SysConfig *sysconfig;
@@ -1,191 +1,601 @@
+/*
+ * Interrupt-driven TWI host with a transaction queue.
+ *
+ * The TWI ISR advances the transaction on the bus byte by byte, so the CPU is free (or can
+ * sleep in idle mode) while bytes are on the wire. The blocking functions below are thin
+ * wrappers that submit a transaction and wait for its completion.
+ *
+ * All devices share one bus. Queued transactions are started in order of their device's
+ * priority (see twi_set_priority()), and in submission order within the same priority,
+ * so that e.g. FUSB302 accesses don't have to wait behind a burst of LED writes.
+ *
+ * If the bus gets stuck (e.g. a client holding SDA low after a glitch), it is recovered from
+ * the main context (twi_run(), or while waiting for a transaction) by clocking out the client
+ * and sending a STOP, and the transaction is retried.
+ */
 #include "twi.h"
+#include "insomnia.h"
+#include "rtc.h"
+#include "profile.h"
+#include "event.h"
+#ifdef TWI_BENCHMARK
+#include "debug.h"
+#endif
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/delay.h>
 #include <stdbool.h>
+#include <string.h>
+#include <util/atomic.h>
 
 #define TWI_READ true
-#define TWI_WRITE false
 
-#define TWI_IS_CLOCKHELD() TWI0.MSTATUS & TWI_CLKHOLD_bm
-#define TWI_IS_BUSERR() TWI0.MSTATUS & TWI_BUSERR_bm
-#define TWI_IS_ARBLOST() TWI0.MSTATUS & TWI_ARBLOST_bm
-#define CLIENT_NACK() TWI0.MSTATUS & TWI_RXACK_bm
+#define TWI_QUEUE_SIZE 8
+#define TWI_MAX_DEVICES 4
+// Number of times a transaction is retried after a bus recovery
+#define TWI_MAX_RETRIES 1
+
+#define TWI_SCL_PIN PIN0_bm
+#define TWI_SDA_PIN PIN1_bm
+
 #define TWI_IS_BUSBUSY() ((TWI0.MSTATUS & TWI_BUSSTATE_BUSY_gc) == TWI_BUSSTATE_BUSY_gc)
-#define TWI_IS_BAD() (((TWI0.MSTATUS & (TWI_RXACK_bm | TWI_ARBLOST_bm | TWI_BUSERR_bm)) != 0) || (TWI_IS_BUSBUSY()))
-#define TWI_WAIT() while (!((TWI_IS_CLOCKHELD()) || (TWI_IS_BUSERR()) || (TWI_IS_ARBLOST()) || (TWI_IS_BUSBUSY())))
 #define TWI_STOP() {TWI0.MCTRLB |= TWI_MCMD_STOP_gc; while ((TWI0.MSTATUS & TWI_BUSSTATE_gm) != TWI_BUSSTATE_IDLE_gc); }
+#define TWI_NACK_STOP() {TWI0.MCTRLB = TWI_ACKACT_NACK_gc | TWI_MCMD_STOP_gc; while ((TWI0.MSTATUS & TWI_BUSSTATE_gm) != TWI_BUSSTATE_IDLE_gc); }
+
+#define TWI_NO_SLOT 0xFF
+
+typedef struct {
+    uint8_t baud;
+    uint8_t ctrla;
+} TwiSpeedConfig;
+
+// fSCL = fCLK / (10 + 2 * BAUD + fCLK * tRise), with tRise of about 100-200 ns (4.7k pull-ups)
+static const TwiSpeedConfig speed_configs[] = {
+    [TWI_SPEED_400K] = { .baud = 20, .ctrla = TWI_SDAHOLD_50NS_gc },
+    [TWI_SPEED_1M] = { .baud = 4, .ctrla = TWI_SDAHOLD_50NS_gc | TWI_FMPEN_bm },
+};
+
+typedef enum {
+    TWI_SLOT_FREE = 0,
+    TWI_SLOT_QUEUED,
+    TWI_SLOT_ACTIVE,
+    TWI_SLOT_DONE,
+    TWI_SLOT_FAILED
+} TwiSlotState;
+
+typedef struct {
+    uint8_t addr;               // 0 = unused entry
+    TwiPriority priority;
+    TwiSpeed speed;
+    uint16_t max_latency;       // worst-case queueing latency in bus bytes
+    uint16_t errors;            // failed transactions (including retried ones)
+    uint32_t transactions;      // completed transactions (successful or not)
+    uint32_t bytes;             // bytes (including address bytes) of the completed transactions
+    bool alive;                 // last transaction succeeded
+    uint32_t last_success;      // RTC ticks (rtc_get_ticks32()) of the last successful transaction
+} TwiDevice;
+
+typedef struct {
+    TwiTransaction t;
+    volatile TwiSlotState state;
+    TwiDevice *dev;
+    uint8_t seq;                // submission order, for FIFO within the same priority
+    uint16_t submit_bytes;      // value of bus_bytes at submission
+    uint16_t start_bytes;       // value of bus_bytes when (last) started
+    uint8_t retries;
+} TwiSlot;
+
+static TwiSlot queue[TWI_QUEUE_SIZE];
+static TwiDevice devices[TWI_MAX_DEVICES];
+static volatile uint8_t queue_count = 0;    // queued or active slots
+static uint8_t next_slot = 0;               // where to start looking for a free slot (main context only)
+static uint8_t next_seq = 0;
 
-static bool twi_start(uint8_t addr, bool read);
-static void twi_read_from(uint8_t* data, uint8_t len);
-static bool twi_write_to(uint8_t* data, uint8_t len);
+// Bytes (including address bytes) transferred on the bus so far. Used as a clock to measure
+// queueing latency: at 400 kHz, one byte takes 22.5 us.
+static volatile uint16_t bus_bytes = 0;
+static volatile uint16_t bus_recoveries = 0;
+// Set when the bus got stuck. Recovery takes about 100 us of bit-banging, which is done in the
+// main context (twi_run(), twi_idle()) so as not to hold up other ISRs (e.g. the SPI RTC).
+static volatile bool recovery_pending = false;
+static TwiSpeed current_speed = TWI_SPEED_400K;
 
-void twi_init(void) {        
+// Progress of the active transaction
+static volatile uint8_t active_slot = TWI_NO_SLOT;
+static uint8_t xfer_pos;
+static bool xfer_reading;
+
+static TwiDevice *twi_device(uint8_t addr);
+static void twi_configure(void);
+static void twi_recover_bus(void);
+static void twi_bus_error(void);
+static void twi_start_next(void);
+static void twi_finish(bool success);
+static void twi_service(void);
+static void twi_idle(void);
+static bool twi_transfer(uint8_t addr, const uint8_t *header, uint8_t header_len,
+                         const uint8_t *wdata, uint8_t wlen, uint8_t *rdata, uint8_t rlen);
+
+void twi_init(void) {
     // Configure pins for output
-    PORTB.DIRSET = PIN1_bm | PIN0_bm;
-    
-    // 400kHz TWI, 4 cycle SDA setup, 50ns SDA Hold Time
-    TWI0.CTRLA = TWI_SDAHOLD_50NS_gc;
-      
+    PORTB.DIRSET = TWI_SDA_PIN | TWI_SCL_PIN;
+    twi_configure();
+    TWI0.MSTATUS = TWI_BUSSTATE_IDLE_gc;
+}
+
+// Configures TWI0 for current_speed. The peripheral must be disabled.
+static void twi_configure(void) {
+    // 4 cycle SDA setup, 50ns SDA Hold Time, Fast mode plus drive strength if needed
+    TWI0.CTRLA = speed_configs[current_speed].ctrla;
+
     // Clear MSTATUS (write 1 to flags). BUSSTATE set to idle
     TWI0.MSTATUS = TWI_RIF_bm | TWI_WIF_bm | TWI_CLKHOLD_bm | TWI_RXACK_bm |
             TWI_ARBLOST_bm | TWI_BUSERR_bm | TWI_BUSSTATE_IDLE_gc;
-    
-    // Set for 400kHz from a 20MHz oscillator, no CLKDIV
-    TWI0.MBAUD = 20;
-   
-    // No ISRs, host mode, timeout after 200 us
-    TWI0.MCTRLA = TWI_ENABLE_bm | TWI_TIMEOUT_200US_gc;
+
+    // From a 20MHz oscillator, no CLKDIV
+    TWI0.MBAUD = speed_configs[current_speed].baud;
+
+    // Read/write ISRs, host mode, timeout after 200 us
+    TWI0.MCTRLA = TWI_RIEN_bm | TWI_WIEN_bm | TWI_ENABLE_bm | TWI_TIMEOUT_200US_gc;
+}
+
+void twi_set_priority(uint8_t addr, TwiPriority priority) {
+    TwiDevice *dev = twi_device(addr);
+    if (dev) {
+        dev->priority = priority;
+    }
+}
+
+void twi_set_speed(uint8_t addr, TwiSpeed speed) {
+    TwiDevice *dev = twi_device(addr);
+    if (dev) {
+        dev->speed = speed;
+    }
+}
+
+uint16_t twi_get_max_latency(uint8_t addr) {
+    TwiDevice *dev = twi_device(addr);
+    return dev ? dev->max_latency : 0;
+}
+
+uint16_t twi_get_errors(uint8_t addr) {
+    TwiDevice *dev = twi_device(addr);
+    uint16_t errors = 0;
+    if (dev) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            errors = dev->errors;
+        }
+    }
+    return errors;
+}
+
+uint32_t twi_get_transactions(uint8_t addr) {
+    TwiDevice *dev = twi_device(addr);
+    uint32_t transactions = 0;
+    if (dev) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            transactions = dev->transactions;
+        }
+    }
+    return transactions;
+}
+
+uint32_t twi_get_bytes(uint8_t addr) {
+    TwiDevice *dev = twi_device(addr);
+    uint32_t bytes = 0;
+    if (dev) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            bytes = dev->bytes;
+        }
+    }
+    return bytes;
 }
 
-static bool twi_start(uint8_t addr, bool read) {
-    if (TWI_IS_BUSBUSY()){
+uint16_t twi_get_bus_recoveries(void) {
+    uint16_t recoveries;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        recoveries = bus_recoveries;
+    }
+    return recoveries;
+}
+
+bool twi_device_alive(uint8_t addr, uint32_t max_silence) {
+    TwiDevice *dev = twi_device(addr);
+    if (!dev) {
         return false;
     }
-    
-    // Send address
-    TWI0.MADDR = (addr << 1) | read;
-    
-    TWI_WAIT();
-                
-    if (TWI_IS_BAD()){
-        TWI_STOP();
+    bool alive;
+    uint32_t last_success;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        alive = dev->alive;
+        last_success = dev->last_success;
+    }
+    return alive && rtc_get_ticks32() - last_success <= max_silence;
+}
+
+uint8_t twi_submit(const TwiTransaction *t) {
+    while (queue_count == TWI_QUEUE_SIZE) {
+        // Queue full - wait for a transaction to complete
+        twi_idle();
+    }
+
+    // Find a free slot, starting after the one used last, so that handles of completed
+    // transactions remain valid for as long as possible
+    uint8_t handle = next_slot;
+    while (queue[handle].state == TWI_SLOT_QUEUED || queue[handle].state == TWI_SLOT_ACTIVE) {
+        handle = (handle + 1) % TWI_QUEUE_SIZE;
+    }
+    next_slot = (handle + 1) % TWI_QUEUE_SIZE;
+
+    TwiSlot *slot = &queue[handle];
+    slot->t = *t;
+    slot->dev = twi_device(t->addr);
+    slot->seq = next_seq++;
+    slot->retries = 0;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        PROFILE_BEGIN();
+        slot->submit_bytes = bus_bytes;
+        slot->state = TWI_SLOT_QUEUED;
+        queue_count++;
+        if (active_slot == TWI_NO_SLOT) {
+            // Bus was idle
+            insomnia_mask |= INSOMNIA_TWI;
+            twi_start_next();
+        }
+        PROFILE_END(PROFILE_IRQOFF_TWI);
+    }
+    return handle;
+}
+
+bool twi_is_done(uint8_t handle) {
+    return queue[handle].state >= TWI_SLOT_DONE;
+}
+
+bool twi_wait(uint8_t handle) {
+    while (!twi_is_done(handle)) {
+        twi_idle();
+    }
+    return queue[handle].state == TWI_SLOT_DONE;
+}
+
+void twi_flush(void) {
+    while (queue_count > 0) {
+        twi_idle();
+    }
+}
+
+bool twi_send_bytes_async(uint8_t addr, const uint8_t *data, uint8_t len) {
+    if (len > TWI_HEADER_MAX) {
+        // The data is copied into the header, as the caller's buffer may be gone by the time
+        // the transaction is started; longer writes must use twi_submit() with wdata
         return false;
     }
-    
+    TwiTransaction t = {
+        .addr = addr,
+        .header_len = len
+    };
+    memcpy(t.header, data, len);
+    twi_submit(&t);
     return true;
 }
 
-// Reads len bytes from TWI, then issues a bus STOP
-static void twi_read_from(uint8_t* data, uint8_t len) {
-    uint8_t bCount = 0;
-    
-    TWI0.MSTATUS = TWI_CLKHOLD_bm;
-    
-    while (bCount < len) {
-        TWI_WAIT();
-        
-        data[bCount] = TWI0.MDATA;
-        bCount += 1;        
-        if (bCount != len) {
+// Returns the statistics/configuration entry for a device, creating it if necessary
+static TwiDevice *twi_device(uint8_t addr) {
+    TwiDevice *free_dev = 0;
+    for (uint8_t i = 0; i < TWI_MAX_DEVICES; i++) {
+        if (devices[i].addr == addr) {
+            return &devices[i];
+        }
+        if (devices[i].addr == 0 && !free_dev) {
+            free_dev = &devices[i];
+        }
+    }
+    if (free_dev) {
+        free_dev->addr = addr;
+    }
+    return free_dev;
+}
+
+// Starts the most urgent queued transaction, if any. The bus must be idle.
+static void twi_start_next(void) {
+    if (recovery_pending) {
+        // Continued by twi_recover_bus(); INSOMNIA_TWI stays set until then
+        return;
+    }
+    if (queue_count > 0) {
+        // Pick the highest priority; among equal priorities, the oldest
+        uint8_t best = TWI_NO_SLOT;
+        for (uint8_t i = 0; i < TWI_QUEUE_SIZE; i++) {
+            if (queue[i].state != TWI_SLOT_QUEUED) {
+                continue;
+            }
+            if (best == TWI_NO_SLOT) {
+                best = i;
+                continue;
+            }
+            TwiPriority prio = queue[i].dev ? queue[i].dev->priority : TWI_PRIORITY_NORMAL;
+            TwiPriority best_prio = queue[best].dev ? queue[best].dev->priority : TWI_PRIORITY_NORMAL;
+            if (prio > best_prio || (prio == best_prio && (int8_t)(queue[i].seq - queue[best].seq) < 0)) {
+                best = i;
+            }
+        }
+
+        TwiSlot *slot = &queue[best];
+        TwiTransaction *t = &slot->t;
+        slot->state = TWI_SLOT_ACTIVE;
+        active_slot = best;
+        xfer_pos = 0;
+        slot->start_bytes = bus_bytes;
+
+        if (slot->dev) {
+            uint16_t latency = bus_bytes - slot->submit_bytes;
+            if (latency > slot->dev->max_latency) {
+                slot->dev->max_latency = latency;
+            }
+        }
+
+        if (TWI_IS_BUSBUSY()) {
+            // There is no other host, so the bus is stuck
+            twi_bus_error();
+            return;
+        }
+
+        TwiSpeed speed = slot->dev ? slot->dev->speed : TWI_SPEED_400K;
+        if (speed != current_speed) {
+            // The baud rate may only be changed while the host is disabled (the bus is idle here)
+            current_speed = speed;
+            TWI0.MCTRLA = 0;
+            twi_configure();
+            TWI0.MSTATUS = TWI_BUSSTATE_IDLE_gc;
+        }
+
+        // Send address; start in read mode if there is nothing to write
+        xfer_reading = (t->header_len + t->wlen) == 0 && t->rlen > 0;
+        TWI0.MADDR = (t->addr << 1) | xfer_reading;
+        return;
+    }
+
+    insomnia_mask &= ~INSOMNIA_TWI;
+}
+
+static void twi_finish(bool success) {
+    TwiSlot *slot = &queue[active_slot];
+
+    slot->state = success ? TWI_SLOT_DONE : TWI_SLOT_FAILED;
+    queue_count--;
+
+    if (slot->dev) {
+        slot->dev->transactions++;
+        slot->dev->bytes += (uint16_t)(bus_bytes - slot->start_bytes);
+        slot->dev->alive = success;
+        if (success) {
+            slot->dev->last_success = rtc_get_ticks32();
+        } else {
+            slot->dev->errors++;
+        }
+    }
+
+    if (slot->t.callback) {
+        slot->t.callback(active_slot, success);
+    }
+    active_slot = TWI_NO_SLOT;
+}
+
+// Advance the active transaction. Called from the TWI ISR, or polled while interrupts are disabled.
+static void twi_service(void) {
+    if (active_slot == TWI_NO_SLOT) {
+        return;
+    }
+
+    TwiTransaction *t = &queue[active_slot].t;
+    uint8_t status = TWI0.MSTATUS;
+
+    if (status & (TWI_ARBLOST_bm | TWI_BUSERR_bm)) {
+        // Lost the bus (glitch, or a client holding SDA low) - nothing to STOP
+        TWI0.MSTATUS = TWI_ARBLOST_bm | TWI_BUSERR_bm;
+        twi_bus_error();
+    } else if (status & TWI_WIF_bm) {
+        bus_bytes++;
+        if (status & TWI_RXACK_bm) {
+            // Client NACKed the address or a data byte - abort
+            TWI_STOP();
+            twi_finish(false);
+        } else if (xfer_pos < t->header_len) {
+            TWI0.MDATA = t->header[xfer_pos++];
+            return;
+        } else if (xfer_pos < t->header_len + t->wlen) {
+            TWI0.MDATA = t->wdata[xfer_pos++ - t->header_len];
+            return;
+        } else if (t->rlen > 0 && !xfer_reading) {
+            // Restart TWI in READ mode
+            xfer_pos = 0;
+            xfer_reading = true;
+            TWI0.MADDR = (t->addr << 1) | TWI_READ;
+            return;
+        } else {
+            TWI_STOP();
+            twi_finish(true);
+        }
+    } else if (status & TWI_RIF_bm) {
+        bus_bytes++;
+        t->rdata[xfer_pos++] = TWI0.MDATA;
+        if (xfer_pos < t->rlen) {
             // If not done, then ACK and read the next byte
             TWI0.MCTRLB = TWI_ACKACT_ACK_gc | TWI_MCMD_RECVTRANS_gc;
+            return;
         }
+        // NACK and STOP the bus
+        TWI_NACK_STOP();
+        twi_finish(true);
+    } else {
+        return;
     }
-    
-    // NACK and STOP the bus
-    TWI0.MCTRLB = TWI_ACKACT_NACK_gc | TWI_MCMD_STOP_gc;
+
+    twi_start_next();
 }
 
-// Write len bytes to TWI. Does NOT STOP the bus. Returns true if successful
-static bool twi_write_to(uint8_t* data, uint8_t len) {
-    uint8_t count = 0;
-    
-    while (count < len) {
-        TWI0.MDATA = data[count];
-        
-        TWI_WAIT();
-        
-        // If the client NACKed, then abort the write
-        if (CLIENT_NACK()) {
-            return false;
+// Handles a bus error on the active transaction: schedules bus recovery, after which it is
+// retried (up to TWI_MAX_RETRIES times), or fails it. Called with interrupts disabled.
+static void twi_bus_error(void) {
+    TwiSlot *slot = &queue[active_slot];
+    TWI0.MCTRLA = 0;
+    recovery_pending = true;
+    insomnia_mask |= INSOMNIA_TWI;
+    event_post(EVENT_TWI_ERROR, 0);
+    if (slot->retries < TWI_MAX_RETRIES) {
+        slot->retries++;
+        if (slot->dev) {
+            slot->dev->errors++;
         }
-        
-        count++;
+        // Back into the queue; it keeps its sequence number, so it is started again right away
+        slot->state = TWI_SLOT_QUEUED;
+        active_slot = TWI_NO_SLOT;
+    } else {
+        twi_finish(false);
     }
-    
-    return true;
 }
 
-bool twi_send_byte(uint8_t addr, uint8_t data) {
-    if (!twi_start(addr, TWI_WRITE)) {
-        TWI_STOP();
-        return false;
+// Frees a stuck bus: a client that was interrupted in the middle of a read may hold SDA low
+// until it has clocked out the rest of its byte. Toggle SCL by hand until SDA is released
+// (at most 9 times), generate a STOP condition and reinitialize the TWI peripheral.
+// Takes about 100 us. Runs with interrupts enabled (if they are); the TWI peripheral is
+// disabled, and no transaction is started until it is done.
+static void twi_recover_bus(void) {
+    bus_recoveries++;
+
+    // Open-drain emulation on the pins: output = low, input = released. Release them first,
+    // then clear OUT, which may have been left high (e.g. by led_wakeup()).
+    PORTB.DIRCLR = TWI_SDA_PIN | TWI_SCL_PIN;
+    PORTB.OUTCLR = TWI_SDA_PIN | TWI_SCL_PIN;
+    for (uint8_t i = 0; i < 9 && !(PORTB.IN & TWI_SDA_PIN); i++) {
+        PORTB.DIRSET = TWI_SCL_PIN;
+        _delay_us(5);
+        PORTB.DIRCLR = TWI_SCL_PIN;
+        _delay_us(5);
+    }
+
+    // STOP: SDA goes high while SCL is high
+    PORTB.DIRSET = TWI_SCL_PIN;
+    _delay_us(5);
+    PORTB.DIRSET = TWI_SDA_PIN;
+    _delay_us(5);
+    PORTB.DIRCLR = TWI_SCL_PIN;
+    _delay_us(5);
+    PORTB.DIRCLR = TWI_SDA_PIN;
+    _delay_us(5);
+
+    // Enable TWI0 before driving the pins again, so that they don't go low after the STOP
+    twi_configure();
+    PORTB.DIRSET = TWI_SDA_PIN | TWI_SCL_PIN;
+    TWI0.MSTATUS = TWI_BUSSTATE_IDLE_gc;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        PROFILE_BEGIN();
+        recovery_pending = false;
+        if (active_slot == TWI_NO_SLOT) {
+            twi_start_next();
+        }
+        PROFILE_END(PROFILE_IRQOFF_TWI);
     }
-    
-    bool success = twi_write_to(&data, 1);
-    
-    TWI0.MCTRLB = TWI_ACKACT_NACK_gc | TWI_MCMD_STOP_gc;
-    
-    return success;
 }
 
-bool twi_send_reg_bytes(uint8_t addr, uint8_t regAddress, uint8_t* data, uint8_t len) {
-    if (!twi_start(addr, TWI_WRITE)) {
-        TWI_STOP();
-        return false;
+void twi_run(void) {
+    if (recovery_pending) {
+        twi_recover_bus();
     }
-    
-    bool success = twi_write_to(&regAddress, 1);
-    success &= twi_write_to(data, len);
+}
 
-    TWI_STOP();
-        
-    return success;
+// Waits for TWI progress, sleeping in idle mode (which keeps TWI running) if interrupts are enabled
+static void twi_idle(void) {
+    if (recovery_pending) {
+        twi_recover_bus();
+    } else if (SREG & CPU_I_bm) {
+        // Use recommended procedure from avr/sleep.h to avoid race conditions
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        cli();
+        if (queue_count > 0) {
+            sleep_enable();
+            sei();
+            sleep_cpu();
+            sleep_disable();
+        }
+        sei();
+    } else if (TWI0.MSTATUS & (TWI_RIF_bm | TWI_WIF_bm)) {
+        // Interrupts are disabled (e.g. during startup) - service the bus by polling
+        twi_service();
+    }
 }
 
-bool twi_send_bytes(uint8_t addr, uint8_t* data, uint8_t len) {
-    if (!twi_start(addr, TWI_WRITE)){
-        TWI_STOP();
-        return false;
+static bool twi_transfer(uint8_t addr, const uint8_t *header, uint8_t header_len,
+                         const uint8_t *wdata, uint8_t wlen, uint8_t *rdata, uint8_t rlen) {
+    TwiTransaction t = {
+        .addr = addr,
+        .header_len = header_len,
+        .wdata = wdata,
+        .wlen = wlen,
+        .rdata = rdata,
+        .rlen = rlen
+    };
+    if (header_len > 0) {
+        memcpy(t.header, header, header_len);
     }
-        
-    bool success = twi_write_to(data, len);
+    return twi_wait(twi_submit(&t));
+}
 
-    TWI_STOP();
-        
-    return success;
+bool twi_send_byte(uint8_t addr, uint8_t data) {
+    return twi_transfer(addr, &data, 1, 0, 0, 0, 0);
 }
 
-bool twi_read_byte(uint8_t addr, uint8_t* data) {
-    if (!twi_start(addr, TWI_READ)) {
-        TWI_STOP();
-        return false;
-    }
-        
-    twi_read_from(data, 1);
+bool twi_send_reg_bytes(uint8_t addr, uint8_t regAddress, uint8_t* data, uint8_t len) {
+    return twi_transfer(addr, &regAddress, 1, data, len, 0, 0);
+}
 
-    return true;
+bool twi_send_bytes(uint8_t addr, uint8_t* data, uint8_t len) {
+    return twi_transfer(addr, 0, 0, data, len, 0, 0);
 }
 
+bool twi_read_byte(uint8_t addr, uint8_t* data) {
+    return twi_transfer(addr, 0, 0, 0, 0, data, 1);
+}
 
 bool twi_read_bytes(uint8_t addr, uint8_t* data, uint8_t len){
-    if (!twi_start(addr, TWI_READ)) {
-        TWI_STOP();
-        return false;
-    }
-    
-    twi_read_from(data, len);
-    
-    return true;
+    return twi_transfer(addr, 0, 0, 0, 0, data, len);
 }
 
 bool twi_send_and_read_bytes(uint8_t addr, uint8_t regAddress, uint8_t* data, uint8_t len)
 {
-    if (!twi_start(addr, TWI_WRITE)) {
-        TWI_STOP();
-        return false;
-    }
-        
-    if (!twi_write_to(&regAddress, 1)) {
-        TWI_STOP();
-        return false;
+    return twi_transfer(addr, &regAddress, 1, 0, 0, data, len);
+}
+
+#ifdef TWI_BENCHMARK
+void twi_benchmark(uint8_t addr, uint8_t reg, uint8_t len) {
+    uint8_t data[16];
+    TwiDevice *dev = twi_device(addr);
+    if (!dev || len > sizeof(data)) {
+        return;
     }
-    
-    // Restart TWI in READ mode
-    TWI0.MADDR |= TWI_READ;
-    TWI0.MCTRLB |= TWI_MCMD_REPSTART_gc;
-    
-    TWI_WAIT();
-    
-    if (TWI_IS_BAD()) {
-        //Stop the TWI Bus if an error occurred
-        TWI0.MCTRLB = TWI_MCMD_STOP_gc;
-        return false;
+    TwiSpeed saved_speed = dev->speed;
+    for (uint8_t speed = TWI_SPEED_400K; speed <= TWI_SPEED_1M; speed++) {
+        twi_set_speed(addr, speed);
+        uint16_t errors = twi_get_errors(addr);
+        uint16_t start = rtc_get_ticks();
+        for (uint8_t i = 0; i < 100; i++) {
+            twi_send_and_read_bytes(addr, reg, data, len);
+        }
+        // 100 transactions in 1/1024 s -> about 10 us per transaction and tick
+        uint16_t elapsed = rtc_get_ticks() - start;
+        debug_printf("TWI benchmark %02x speed %u: %u ticks per 100 x %u bytes, %u errors\n",
+                     addr, speed, elapsed, len, twi_get_errors(addr) - errors);
     }
-    
-    twi_read_from(data, len);
-    
-    TWI_STOP();
-    
-    return true;
+    twi_set_speed(addr, saved_speed);
+}
+#endif
+
+ISR(TWI0_TWIM_vect) {
+    PROFILE_BEGIN();
+    twi_service();
+    PROFILE_END(PROFILE_ISR_TWI);
 }
@@ -1,9 +1,77 @@
 #pragma once
-    
+
 #include <stdbool.h>
 #include <stdint.h>
 
+// Number of bytes that are copied into the queue along with a transaction
+// (register address plus a small payload)
+#define TWI_HEADER_MAX 3
+
+// Completion callback; called from ISR context, must not submit new transactions
+typedef void (*TwiCallback)(uint8_t handle, bool success);
+
+typedef enum {
+    TWI_PRIORITY_NORMAL = 0,
+    TWI_PRIORITY_HIGH
+} TwiPriority;
+
+typedef enum {
+    TWI_SPEED_400K = 0,     // Fast mode (default)
+    TWI_SPEED_1M            // Fast mode plus
+} TwiSpeed;
+
+typedef struct {
+    uint8_t addr;
+    uint8_t header[TWI_HEADER_MAX];   // written first; copied on submit
+    uint8_t header_len;
+    const uint8_t *wdata;             // written after the header; must remain valid until completion
+    uint8_t wlen;
+    uint8_t *rdata;                   // read after a repeated start (or right away if nothing is written)
+    uint8_t rlen;
+    TwiCallback callback;             // may be NULL
+} TwiTransaction;
+
 void twi_init(void);
+// Recover the bus if it got stuck (EVENT_TWI_ERROR). Called from the main loop.
+void twi_run(void);
+
+// Set the priority of all transactions to a device. Pending transactions of higher priority
+// are started before those of lower priority.
+void twi_set_priority(uint8_t addr, TwiPriority priority);
+// Set the bus speed for transactions to a device (applied whenever one of them is started)
+void twi_set_speed(uint8_t addr, TwiSpeed speed);
+// Worst-case time that a transaction to the given device had to wait in the queue before being
+// started, in bytes transferred on the bus in the meantime (22.5 us each at 400 kHz)
+uint16_t twi_get_max_latency(uint8_t addr);
+// Returns true if the last transaction to the given device succeeded, and not more than
+// max_silence RTC ticks ago. Used as proof of liveness instead of probing the device.
+bool twi_device_alive(uint8_t addr, uint32_t max_silence);
+// Number of failed transactions to the given device (including ones that succeeded on retry)
+uint16_t twi_get_errors(uint8_t addr);
+// Number of completed transactions to the given device, as a measure of bus traffic
+uint32_t twi_get_transactions(uint8_t addr);
+// Number of bytes (including address bytes) transferred to and from the given device
+uint32_t twi_get_bytes(uint8_t addr);
+// Number of times the bus has been recovered after getting stuck
+uint16_t twi_get_bus_recoveries(void);
+
+#ifdef TWI_BENCHMARK
+// Measure and print the time for reading len bytes from reg of the device at each speed
+void twi_benchmark(uint8_t addr, uint8_t reg, uint8_t len);
+#endif
+
+// Queue a transaction and return a handle for it. Blocks (in idle sleep) only if the queue is full.
+// The handle of a completed transaction may be reused by later submissions, so check it soon after completion.
+uint8_t twi_submit(const TwiTransaction *t);
+bool twi_is_done(uint8_t handle);
+// Wait for a transaction to complete. Returns true if it was successful.
+bool twi_wait(uint8_t handle);
+// Wait until all queued transactions have completed
+void twi_flush(void);
+
+// Queue a short write (up to TWI_HEADER_MAX bytes) without waiting for its completion.
+// Returns false (without queueing anything) if len is too large.
+bool twi_send_bytes_async(uint8_t addr, const uint8_t *data, uint8_t len);
 
 bool twi_send_byte(uint8_t addr, uint8_t data);
 bool twi_send_bytes(uint8_t addr, uint8_t* data, uint8_t len);
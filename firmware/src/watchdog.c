@@ -2,23 +2,38 @@
 #include "bq.h"
 #include "fsc_pd_ctl.h"
 #include "watchdog.h"
+#include "sched.h"
+#include "twi.h"
+
+// Wake up at least this often to service the watchdog (half of its timeout)
+#define WATCHDOG_INTERVAL_TICKS (4 * 1024UL)
+// Only probe a device if there hasn't been a successful transaction to it for this long
+#define WATCHDOG_SILENCE_TICKS 1024
 
 void watchdog_init(void) {
 #ifndef WATCHDOG_DISABLE
     // Enable watchdog with 8s timeout
     wdt_enable(0xB);
+
+    // The first tickle only comes after the first sleep, which must not outlast the timeout.
+    // RTC.CNT is 0 after any reset and starts counting in rtc_init(), so the deadline holds.
+    sched_set(SCHED_WATCHDOG, WATCHDOG_INTERVAL_TICKS);
 #endif
 }
 
 void watchdog_tickle(void) {
 #ifndef WATCHDOG_DISABLE
-    // Query BQ to make sure we can communicate with it via I2C
-    if (!bq_test_connection()) {
+    // Nothing else wakes us up periodically, so make sure we get back here in time
+    sched_set(SCHED_WATCHDOG, WATCHDOG_INTERVAL_TICKS);
+
+    // Make sure we can communicate with the BQ and FUSB302 via I2C. Recent successful
+    // transactions are proof enough; otherwise (including after a failure) query them.
+    if (!twi_device_alive(BQ_ADDR, WATCHDOG_SILENCE_TICKS) && !bq_test_connection()) {
         // Communication failure - do not reset watchdog, let system reset
         return;
     }
 
-    if (!fsc_pd_test_connection()) {
+    if (!twi_device_alive(FUSB302_I2C_ADDR, WATCHDOG_SILENCE_TICKS) && !fsc_pd_test_connection()) {
         // Communication failure - do not reset watchdog, let system reset
         return;
     }
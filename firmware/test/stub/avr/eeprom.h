@@ -0,0 +1,4 @@
+/* Host stand-in; sysconfig.h only needs it for EEMEM */
+#pragma once
+
+#define EEMEM
@@ -0,0 +1,18 @@
+/* Host stand-in for the few I/O registers touched by the modules under test */
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+    uint8_t DIRSET;
+    uint8_t OUTSET;
+    uint8_t PIN6CTRL;
+    uint8_t PIN7CTRL;
+} PORT_t;
+
+extern PORT_t PORTA;
+
+#define PIN7_bm 0x80
+#define PORT_PULLUPEN_bm 0x08
+#define PORT_INVEN_bm 0x80
+#define PORT_ISC_RISING_gc 0x02
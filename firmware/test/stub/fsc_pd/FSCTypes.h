@@ -0,0 +1,13 @@
+/* Host stand-in for the FSC PD type definitions used by platform.h */
+#pragma once
+
+#include <stdint.h>
+
+typedef uint8_t FSC_U8;
+typedef uint16_t FSC_U16;
+typedef uint32_t FSC_U32;
+typedef int32_t FSC_S32;
+typedef uint8_t FSC_BOOL;
+
+#define TRUE 1
+#define FALSE 0
@@ -0,0 +1,18 @@
+/* Host stand-in for the parts of the FSC PD core that the charger state machine uses */
+#pragma once
+
+#include "platform.h"
+#include "fsc_pd/timer.h"
+
+typedef enum {
+    Disabled = 0,
+    Unattached,
+    AttachedSink,
+    AttachedSource
+} ConnectionState;
+
+typedef enum {
+    peDisabled = 0,
+    peSinkReady,
+    peSourceReady
+} PolicyState_t;
@@ -0,0 +1,16 @@
+/* Host stand-in for the FSC PD timers; periods are in RTC ticks, as on the device */
+#pragma once
+
+#include "fsc_pd/FSCTypes.h"
+
+struct TimerObj {
+    FSC_U32 starttime;
+    FSC_U32 period;
+};
+
+void TimerStart(struct TimerObj *obj, FSC_U32 time);
+void TimerRestart(struct TimerObj *obj);
+void TimerDisable(struct TimerObj *obj);
+FSC_BOOL TimerDisabled(struct TimerObj *obj);
+FSC_BOOL TimerExpired(struct TimerObj *obj);
+FSC_U32 TimerRemaining(struct TimerObj *obj);
@@ -0,0 +1,735 @@
+/*
+ * Host-side simulation of the charger state machine (src/charger_sm.c) and the BQ25792 driver
+ * (src/bq.c) against a minimal register-level model of the BQ25792 with a 3S Li-ion pack.
+ * The main loop is reproduced as far as the charger is concerned (BQ interrupts, ADC runs and
+ * charger_sm_run() timeouts), and simulated time only advances while it sleeps. The PD stack
+ * and the KX2 are reduced to the getters that the state machine reads.
+ *
+ * For each scenario, the time to full, the number of I2C transactions to the BQ and the number
+ * of main loop wakeups are reported, so that changes to the charger logic can be compared.
+ * Run with -v to see the debug output of the modules under test.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <avr/io.h>
+
+#include "charger_sm.h"
+#include "bq.h"
+#include "fsc_pd_ctl.h"
+#include "kx2.h"
+#include "led.h"
+#include "sysconfig.h"
+#include "debug.h"
+#include "rtc.h"
+#include "twi.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        failures++; \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+    } \
+} while (0)
+
+#define TICKS_PER_SECOND 1024
+#define TICKS_PER_HOUR (3600UL * TICKS_PER_SECOND)
+
+// Battery pack: 3S Li-ion, 2600 mAh, 150 mOhm including wiring
+#define CELLS 3
+#define CAPACITY_MAS (2600.0 * 3600)
+#define PACK_RESISTANCE 0.15
+
+// Charger: conversion efficiency, termination current (REG09 default), recharge threshold
+#define EFFICIENCY 0.9
+#define ITERM_MA 200
+#define VRECHG_MV 300
+
+// Longest time the model is advanced without looking at its state again
+#define MODEL_STEP_TICKS TICKS_PER_SECOND
+
+static bool verbose = false;
+static uint32_t now = 0;
+
+/* ===== Environment: input sources, KX2, PD stack ===== */
+
+static struct {
+    bool usb_source;            // a USB power source is attached (VBUS/VAC1)
+    uint16_t usb_mv;            // its voltage (5 V until a PD contract is in place)
+    uint16_t usb_ma;            // its current capability
+    uint16_t usb_bc12_ma;       // IINDPM resulting from D+/D- detection
+    bool dc;                    // DC jack (VAC2)
+    uint16_t dc_mv;
+    bool kx2_on;
+    uint16_t otg_load_ma;       // load of a sink attached in OTG mode
+    uint8_t fault;              // REG20 fault bits to report
+    ConnectionState conn;
+    bool contract;
+    uint16_t adv_current;
+} world;
+
+ConnectionState fsc_pd_get_connection_state(void) {
+    return world.conn;
+}
+
+PolicyState_t fsc_pd_get_policy_state(void) {
+    if (!world.contract) {
+        return peDisabled;
+    }
+    return world.conn == AttachedSource ? peSourceReady : peSinkReady;
+}
+
+uint16_t fsc_pd_get_advertised_current(void) {
+    return world.adv_current;
+}
+
+bool fsc_pd_policy_has_contract(void) {
+    return world.contract;
+}
+
+bool kx2_is_on(void) {
+    return world.kx2_on;
+}
+
+/* ===== Platform stubs ===== */
+
+PORT_t PORTA;
+
+static struct SysConfig config = {
+    .magic = SYSCONFIG_MAGIC,
+    .role = DRP,
+    .pdMode = PD_3_0,
+    .chargingCurrentLimit = 3000,
+    .chargingVoltageLimit = 12600,
+    .dcInputCurrentLimit = 3000,
+    .otgCurrentLimit = 3000,
+    .dischargingVoltageLimit = 9000,
+    .otgVoltageHeadroom = 100,
+    .chargeWhenRigIsOn = false,
+    .enableThermistor = false,
+};
+struct SysConfig *sysconfig = &config;
+
+uint16_t rtc_get_ticks(void) {
+    return (uint16_t)now;
+}
+
+uint32_t rtc_get_ticks32(void) {
+    return now;
+}
+
+void debug_printf(const char *fmt, ...) {
+    if (verbose) {
+        va_list args;
+        va_start(args, fmt);
+        printf("%8.1f s: ", now / (double)TICKS_PER_SECOND);
+        vprintf(fmt, args);
+        va_end(args);
+    }
+}
+
+void led_off(void) {}
+void led_set_color(bool red, bool green, bool blue, uint8_t brightness) {}
+void led_set_blinking(bool red, bool green, bool blue, uint8_t brightness, uint8_t t_on, uint8_t t_off, uint8_t count, uint8_t pause) {}
+void led_set_breathing(bool red, bool green, bool blue, uint8_t brightness, uint8_t speed) {}
+void led_shutdown(void) {}
+void led_wakeup(void) {}
+
+// Periods are in RTC ticks; a period of 0 means disabled
+void TimerStart(struct TimerObj *obj, FSC_U32 time) {
+    obj->starttime = now;
+    obj->period = time;
+}
+
+void TimerRestart(struct TimerObj *obj) {
+    obj->starttime = now;
+}
+
+void TimerDisable(struct TimerObj *obj) {
+    obj->period = 0;
+}
+
+FSC_BOOL TimerDisabled(struct TimerObj *obj) {
+    return obj->period == 0;
+}
+
+FSC_BOOL TimerExpired(struct TimerObj *obj) {
+    return !TimerDisabled(obj) && now - obj->starttime >= obj->period;
+}
+
+FSC_U32 TimerRemaining(struct TimerObj *obj) {
+    if (TimerDisabled(obj) || TimerExpired(obj)) {
+        return 0;
+    }
+    return obj->period - (now - obj->starttime);
+}
+
+/* ===== BQ25792 model ===== */
+
+static struct {
+    uint8_t reg[0x49];
+    uint8_t status[7];          // REG1B..REG21 as last reported
+    double charge_mas;          // charge stored in the pack
+    double ibat;                // mA, positive while charging
+    double ibus;                // mA
+    ChargeStatus chg_stat;
+    bool adc_busy;
+    uint32_t adc_end;
+    bool interrupt;             // BQ_INT pulse not yet seen by the main loop
+} bq;
+
+static uint32_t bq_transactions = 0;
+
+// Open circuit voltage of one cell in mV at 0, 10, ..., 100 % state of charge
+static const uint16_t cell_ocv[11] = {3000, 3450, 3600, 3680, 3740, 3800, 3870, 3950, 4040, 4110, 4200};
+
+static double model_soc(void) {
+    double soc = bq.charge_mas / CAPACITY_MAS;
+    return soc < 0 ? 0 : (soc > 1 ? 1 : soc);
+}
+
+static double model_ocv(void) {
+    double x = model_soc() * 10;
+    int i = x >= 10 ? 9 : (int)x;
+    return CELLS * (cell_ocv[i] + (x - i) * (cell_ocv[i + 1] - cell_ocv[i]));
+}
+
+static double model_vbat(void) {
+    return model_ocv() + bq.ibat * PACK_RESISTANCE;
+}
+
+static uint16_t model_reg16(uint8_t reg) {
+    return (bq.reg[reg] << 8) | bq.reg[reg + 1];
+}
+
+static bool model_otg(void) {
+    return (bq.reg[0x12] & 0x40) && !world.usb_source;
+}
+
+// Input voltage and current limit of the input that the charger draws from, if any
+static bool model_input(double *mv, double *ma) {
+    uint16_t iindpm = model_reg16(0x06) * 10;
+    if (world.dc && (bq.reg[0x13] & 0x80)) {
+        *mv = world.dc_mv;
+        *ma = iindpm;
+        return true;
+    }
+    if (world.usb_source && (bq.reg[0x13] & 0x40)) {
+        *mv = world.usb_mv;
+        *ma = iindpm < world.usb_ma ? iindpm : world.usb_ma;
+        return true;
+    }
+    return false;
+}
+
+static void model_update_current(void) {
+    double vin, iin;
+    bq.ibus = 0;
+    if (model_otg()) {
+        // Supply the sink from the battery
+        double votg = model_reg16(0x0B) * 10 + 2800;
+        bq.ibat = -(votg * world.otg_load_ma / EFFICIENCY) / model_ocv();
+        bq.ibus = -world.otg_load_ma;
+        bq.chg_stat = NOT_CHARGING;
+        return;
+    }
+    if (!model_input(&vin, &iin) || !(bq.reg[0x0F] & 0x20) || world.fault) {
+        bq.ibat = 0;
+        bq.chg_stat = NOT_CHARGING;
+        return;
+    }
+
+    double vreg = model_reg16(0x01) * 10;
+    double ocv = model_ocv();
+    if (bq.chg_stat == CHARGE_DONE) {
+        if (ocv > vreg - VRECHG_MV) {
+            bq.ibat = 0;
+            return;
+        }
+    }
+
+    // Constant current, limited by ICHG and by the input power (IINDPM)
+    double ichg = model_reg16(0x03) * 10;
+    double i = vin * iin * EFFICIENCY / ocv;
+    bq.chg_stat = FAST_CHARGE_CC;
+    if (ichg < i) {
+        i = ichg;
+    }
+    if (ocv < vreg * 2 / 3) {
+        // Precharge current (REG08)
+        i = (bq.reg[0x08] & 0x3F) * 40;
+        bq.chg_stat = PRECHARGE;
+    }
+
+    // Constant voltage at VREG, until the current drops to ITERM
+    double icv = (vreg - ocv) / PACK_RESISTANCE;
+    if (icv < i) {
+        i = icv;
+        bq.chg_stat = TAPER_CHARGE_CV;
+        if (i < ITERM_MA) {
+            i = 0;
+            bq.chg_stat = CHARGE_DONE;
+        }
+    }
+    bq.ibat = i;
+    bq.ibus = i * model_vbat() / EFFICIENCY / vin;
+}
+
+static void model_status(uint8_t *status) {
+    bool otg = model_otg();
+    memset(status, 0, sizeof(bq.status));
+    // REG1B: VBUS_PRESENT, AC1_PRESENT, AC2_PRESENT
+    status[0] = (world.usb_source || otg ? 0x03 : 0) | (world.dc ? 0x04 : 0);
+    // REG1C: CHG_STAT, VBUS_STAT
+    status[1] = (bq.chg_stat << 5) | ((otg ? OTG : (world.usb_source ? USB_DCP : NO_INPUT)) << 1);
+    // REG1D: VBAT_PRESENT
+    status[2] = 0x01;
+    // REG20: faults
+    status[5] = world.fault;
+}
+
+// Set the flags for status changes and pulse BQ_INT for those that are not masked (REG28..REG2D)
+static void model_update_status(void) {
+    uint8_t status[sizeof(bq.status)];
+    model_update_current();
+    model_status(status);
+
+    uint8_t flags[6] = {0};
+    flags[0] = (status[0] ^ bq.status[0]) & 0x06;               // AC1/AC2_PRESENT_FLAG
+    flags[1] = ((status[1] ^ bq.status[1]) & 0xE0) ? 0x80 : 0;  // CHG_FLAG
+    flags[4] = status[5] ^ bq.status[5];                        // fault flags
+    memcpy(bq.status, status, sizeof(status));
+
+    for (uint8_t i = 0; i < sizeof(flags); i++) {
+        bq.reg[0x22 + i] |= flags[i];
+        if (flags[i] & ~bq.reg[0x28 + i]) {
+            bq.interrupt = true;
+        }
+    }
+}
+
+static void model_adc_complete(void) {
+    // REG31..REG42, in the order of BqAdcSnapshot
+    uint16_t values[9] = {
+        (uint16_t)(int16_t)bq.ibus,
+        (uint16_t)(int16_t)bq.ibat,
+        world.usb_source ? world.usb_mv : (model_otg() ? model_reg16(0x0B) * 10 + 2800 : 0),
+        world.usb_source ? world.usb_mv : 0,
+        world.dc ? world.dc_mv : 0,
+        (uint16_t)model_vbat(),
+        (uint16_t)model_vbat(),
+        500,
+        50,
+    };
+    for (uint8_t i = 0; i < 9; i++) {
+        bq.reg[0x31 + 2 * i] = values[i] >> 8;
+        bq.reg[0x32 + 2 * i] = values[i] & 0xFF;
+    }
+    bq.adc_busy = false;
+    bq.reg[0x2E] &= ~0x80;
+    bq.reg[0x24] |= 0x20;   // ADC_DONE_FLAG
+    if (!(bq.reg[0x2A] & 0x20)) {
+        bq.interrupt = true;
+    }
+}
+
+static void model_write(uint8_t reg, uint8_t value) {
+    bq.reg[reg] = value;
+    if (reg == 0x09 && (value & 0x40)) {
+        // REG_RST: back to the POR defaults that matter here
+        memset(bq.reg, 0, 0x2E);
+        bq.reg[0x08] = 0xC3;
+        bq.reg[0x0F] = 0xA2;
+        bq.reg[0x11] = 0x40;
+        bq.reg[0x16] = 0xC0;
+    } else if (reg == 0x11 && (value & 0x80)) {
+        // FORCE_INDET: D+/D- detection sets IINDPM
+        bq.reg[0x11] &= ~0x80;
+        if (world.usb_source) {
+            bq.reg[0x06] = (world.usb_bc12_ma / 10) >> 8;
+            bq.reg[0x07] = (world.usb_bc12_ma / 10) & 0xFF;
+        }
+    } else if (reg == 0x2E && (value & 0x80)) {
+        // One-shot conversion of the enabled channels, 24 ms each at 15 bit
+        uint16_t disabled = bq.reg[0x2F] | (bq.reg[0x30] << 8);
+        uint8_t channels = __builtin_popcount(~disabled & BQ_ADC_DISABLE_MASK);
+        bq.adc_busy = true;
+        bq.adc_end = now + ((channels * 25U) >> ((value >> 4) & 0x03)) + 1;
+    }
+    model_update_status();
+}
+
+static uint8_t model_read(uint8_t reg) {
+    if (reg >= 0x1B && reg <= 0x21) {
+        return bq.status[reg - 0x1B];
+    }
+    uint8_t value = bq.reg[reg];
+    if (reg >= 0x22 && reg <= 0x27) {
+        // Flags are cleared by reading
+        bq.reg[reg] = 0;
+    }
+    return value;
+}
+
+// Advance simulated time, stopping early for a BQ interrupt
+static void model_advance(uint32_t ticks) {
+    uint32_t end = now + ticks;
+    while (now < end && !bq.interrupt) {
+        uint32_t step = end - now;
+        if (step > MODEL_STEP_TICKS) {
+            step = MODEL_STEP_TICKS;
+        }
+        if (bq.adc_busy && bq.adc_end - now < step) {
+            step = bq.adc_end - now;
+        }
+        bq.charge_mas += bq.ibat * step / TICKS_PER_SECOND;
+        now += step;
+        if (bq.adc_busy && now == bq.adc_end) {
+            model_adc_complete();
+        }
+        model_update_status();
+    }
+}
+
+// Apply a change of the environment to the model (e.g. an input source attached)
+static void model_refresh(void) {
+    if (world.usb_source && !(bq.status[0] & 0x02) && (bq.reg[0x11] & 0x40)) {
+        // AUTO_INDET_EN: D+/D- detection on plug-in
+        bq.reg[0x06] = (world.usb_bc12_ma / 10) >> 8;
+        bq.reg[0x07] = (world.usb_bc12_ma / 10) & 0xFF;
+    }
+    model_update_status();
+}
+
+/* ===== TWI stubs, counting the transactions to the BQ ===== */
+
+bool twi_send_bytes(uint8_t addr, uint8_t *data, uint8_t len) {
+    if (addr != BQ_ADDR || len == 0) {
+        return false;
+    }
+    bq_transactions++;
+    for (uint8_t i = 1; i < len; i++) {
+        model_write(data[0] + i - 1, data[i]);
+    }
+    return true;
+}
+
+bool twi_send_reg_bytes(uint8_t addr, uint8_t regAddress, uint8_t *data, uint8_t len) {
+    if (addr != BQ_ADDR) {
+        return false;
+    }
+    bq_transactions++;
+    for (uint8_t i = 0; i < len; i++) {
+        model_write(regAddress + i, data[i]);
+    }
+    return true;
+}
+
+bool twi_send_and_read_bytes(uint8_t addr, uint8_t regAddress, uint8_t *data, uint8_t len) {
+    if (addr != BQ_ADDR) {
+        return false;
+    }
+    bq_transactions++;
+    for (uint8_t i = 0; i < len; i++) {
+        data[i] = model_read(regAddress + i);
+    }
+    return true;
+}
+
+/* ===== Main loop ===== */
+
+static uint32_t wakeups = 0;
+
+// One pass of the main loop (the charger related part), returning the time until the next
+// required wakeup (0 = none)
+static uint32_t main_loop_pass(void) {
+    wakeups++;
+    if (bq.interrupt) {
+        // EVENT_BQ_INT
+        bq.interrupt = false;
+        bq_notify_interrupt();
+    }
+    if (bq_process_interrupts()) {
+        charger_sm_on_bq_interrupt();
+    }
+    uint32_t timeout = bq_adc_run();
+    uint32_t charger_timeout = charger_sm_run();
+    if (charger_timeout != 0 && (timeout == 0 || charger_timeout < timeout)) {
+        timeout = charger_timeout;
+    }
+    return timeout;
+}
+
+// Run the main loop for the given time, sleeping until the next timeout or BQ interrupt
+static void run_for(uint32_t ticks) {
+    uint32_t end = now + ticks;
+    while (now < end) {
+        uint32_t timeout = main_loop_pass();
+        uint32_t sleep = end - now;
+        if (timeout != 0 && timeout < sleep) {
+            sleep = timeout;
+        }
+        model_advance(sleep);
+    }
+}
+
+// Run until the state machine is in the given state, or the time limit is reached
+static bool run_until_state(ChargerState state, uint32_t limit) {
+    uint32_t end = now + limit;
+    while (charger_sm_get_state() != state && now < end) {
+        run_for(TICKS_PER_SECOND);
+    }
+    return charger_sm_get_state() == state;
+}
+
+static bool run_until_full(uint32_t limit) {
+    uint32_t end = now + limit;
+    while (bq_get_charge_status() != CHARGE_DONE && now < end) {
+        run_for(10 * TICKS_PER_SECOND);
+    }
+    // Let the state machine see the final status
+    run_for(TICKS_PER_SECOND);
+    return bq_get_charge_status() == CHARGE_DONE;
+}
+
+/* ===== Scenarios ===== */
+
+typedef struct {
+    uint32_t start;
+    uint32_t transactions;
+    uint32_t wakeups;
+} Measurement;
+
+static void measure_start(Measurement *m) {
+    m->start = now;
+    m->transactions = bq_transactions;
+    m->wakeups = wakeups;
+}
+
+static void measure_report(const Measurement *m, const char *name, uint32_t time_to_full) {
+    double hours = (now - m->start) / (double)TICKS_PER_HOUR;
+    printf("%-20s %6.2f h, ", name, hours);
+    if (time_to_full) {
+        printf("time to full %3lu min, ", (unsigned long)(time_to_full / 60));
+    } else {
+        printf("time to full   - min, ");
+    }
+    printf("BQ I2C %6.0f/h, wakeups %6.0f/h\n",
+           (bq_transactions - m->transactions) / hours, (wakeups - m->wakeups) / hours);
+}
+
+// Power up (cold start) with the given state of charge and nothing attached
+static void setup(double soc) {
+    memset(&world, 0, sizeof(world));
+    world.conn = Unattached;
+    memset(&bq, 0, sizeof(bq));
+    bq.charge_mas = soc * CAPACITY_MAS;
+
+    CHECK(bq_init(config.chargingVoltageLimit, config.chargingCurrentLimit, false), "bq_init failed");
+    model_advance(BQ_RESET_TICKS);
+    CHECK(bq_init_finish(), "bq_init_finish failed");
+    charger_sm_init();
+    run_for(TICKS_PER_SECOND);
+    CHECK(charger_sm_get_state() == CHARGER_DISCONNECTED, "state %d after startup", charger_sm_get_state());
+}
+
+// Detach everything and let the state machine return to CHARGER_DISCONNECTED
+static void teardown(void) {
+    memset(&world, 0, sizeof(world));
+    world.conn = Unattached;
+    model_refresh();
+    charger_sm_on_pps_voltage_update(0);
+    charger_sm_on_pd_state_change();
+    charger_sm_on_kx2_power_change();
+    CHECK(run_until_state(CHARGER_DISCONNECTED, 10 * TICKS_PER_SECOND), "not disconnected after teardown");
+    run_for(10 * TICKS_PER_SECOND);
+}
+
+// A USB-C source is attached: VBUS appears at 5 V, and the PD stack attaches as a sink
+static void attach_usb_source(uint16_t adv_current) {
+    world.usb_source = true;
+    world.usb_mv = 5000;
+    world.usb_ma = adv_current;
+    world.usb_bc12_ma = 1500;
+    world.conn = AttachedSink;
+    world.adv_current = adv_current;
+    model_refresh();
+    charger_sm_on_pd_state_change();
+}
+
+static void pd_contract(uint16_t mv, uint16_t ma) {
+    world.usb_mv = mv;
+    world.usb_ma = ma;
+    world.contract = true;
+    world.adv_current = ma;
+    model_refresh();
+    charger_sm_on_pd_state_change();
+}
+
+// Returns the time to full measured by the state machine
+static uint32_t charge_usb(const char *name, bool pd, uint16_t adv_current) {
+    Measurement m;
+    setup(0.2);
+    measure_start(&m);
+    uint32_t attach = now;
+    attach_usb_source(adv_current);
+    run_for(TICKS_PER_SECOND / 2);
+    if (pd) {
+        pd_contract(15000, 3000);
+        CHECK(run_until_state(CHARGER_USB_PD_CHARGING, 5 * TICKS_PER_SECOND), "%s: no PD charging", name);
+    } else {
+        CHECK(run_until_state(CHARGER_USB_TYPE_C_CHARGING, 5 * TICKS_PER_SECOND), "%s: no Type-C charging", name);
+    }
+    CHECK(bq.reg[0x0F] & 0x20, "%s: charging not enabled", name);
+
+    CHECK(run_until_full(12 * TICKS_PER_HOUR), "%s: not full after 12 h", name);
+    uint32_t time_to_full = charger_sm_get_time_to_full();
+    uint32_t expected = (now - attach) / TICKS_PER_SECOND;
+    CHECK(model_soc() > 0.97, "%s: only %.1f %% charged", name, model_soc() * 100);
+    CHECK(time_to_full > 0 && time_to_full <= expected && time_to_full + 15 >= expected,
+          "%s: time to full %lu s, expected about %lu s", name, (unsigned long)time_to_full, (unsigned long)expected);
+
+    // Charged and idle for an hour with the source still attached
+    run_for(TICKS_PER_HOUR);
+    measure_report(&m, name, time_to_full);
+    teardown();
+    return time_to_full;
+}
+
+static void test_usb_charging(void) {
+    uint32_t pd = charge_usb("USB PD 15 V/3 A", true, 1500);
+    uint32_t type_c = charge_usb("USB Type-C 1.5 A", false, 1500);
+    CHECK(pd < type_c, "PD charging (%lu s) not faster than Type-C (%lu s)", (unsigned long)pd, (unsigned long)type_c);
+}
+
+static void test_dc_charging_rig_on(void) {
+    Measurement m;
+    setup(0.5);
+    measure_start(&m);
+    world.dc = true;
+    world.dc_mv = 13800;
+    model_refresh();
+    CHECK(run_until_state(CHARGER_DC_CHARGING, 5 * TICKS_PER_SECOND), "no DC charging");
+    run_for(600 * TICKS_PER_SECOND);
+    CHECK(bq.ibat > 1000, "DC charging current %.0f mA", bq.ibat);
+
+    // The rig is turned on for ten minutes
+    world.kx2_on = true;
+    charger_sm_on_kx2_power_change();
+    CHECK(run_until_state(CHARGER_RIG_ON, 5 * TICKS_PER_SECOND), "not inhibited by the rig");
+    CHECK(!(bq.reg[0x0F] & 0x20), "charging enabled while the rig is on");
+    run_for(600 * TICKS_PER_SECOND);
+    world.kx2_on = false;
+    charger_sm_on_kx2_power_change();
+    CHECK(run_until_state(CHARGER_DC_CHARGING, 5 * TICKS_PER_SECOND), "no DC charging after the rig is off");
+    CHECK(bq.reg[0x0F] & 0x20, "charging not enabled again");
+
+    CHECK(run_until_full(12 * TICKS_PER_HOUR), "not full after 12 h");
+    measure_report(&m, "DC jack, rig on", charger_sm_get_time_to_full());
+    teardown();
+}
+
+static void test_fault(void) {
+    Measurement m;
+    setup(0.5);
+    measure_start(&m);
+    attach_usb_source(1500);
+    pd_contract(15000, 3000);
+    CHECK(run_until_state(CHARGER_USB_PD_CHARGING, 5 * TICKS_PER_SECOND), "no PD charging");
+    run_for(60 * TICKS_PER_SECOND);
+
+    world.fault = 0x40;     // VBUS_OVP_STAT
+    model_refresh();
+    CHECK(run_until_state(CHARGER_FAULT, 5 * TICKS_PER_SECOND), "fault not detected");
+    run_for(10 * TICKS_PER_SECOND);
+    world.fault = 0;
+    model_refresh();
+    CHECK(run_until_state(CHARGER_USB_PD_CHARGING, 5 * TICKS_PER_SECOND), "no PD charging after the fault");
+    CHECK(bq.reg[0x0F] & 0x20, "charging not enabled after the fault");
+    run_for(60 * TICKS_PER_SECOND);
+    measure_report(&m, "USB PD, fault", 0);
+    teardown();
+}
+
+static void test_otg_until_low(void) {
+    Measurement m;
+    setup(0.3);
+    measure_start(&m);
+
+    // A sink is attached, and the PD stack negotiates 5 V via PPS
+    world.conn = AttachedSource;
+    world.contract = true;
+    charger_sm_on_pd_state_change();
+    charger_sm_on_pps_current_update(3000);
+    charger_sm_on_pps_voltage_update(5000);
+    world.otg_load_ma = 2000;
+    model_refresh();
+    CHECK(run_until_state(CHARGER_DISCHARGING, 5 * TICKS_PER_SECOND), "no OTG mode");
+    CHECK(bq.reg[0x12] & 0x40, "EN_OTG not set");
+
+    CHECK(run_until_state(CHARGER_DISCHARGING_BLOCKED, 4 * TICKS_PER_HOUR), "OTG not stopped at low battery");
+    // The measurement under load that ended OTG mode
+    uint16_t vbat = bq_read_adc_snapshot()->vbat;
+    CHECK(!(bq.reg[0x12] & 0x40), "EN_OTG still set at low battery");
+    CHECK(vbat < config.dischargingVoltageLimit && vbat > config.dischargingVoltageLimit - 100,
+          "OTG stopped at %u mV", vbat);
+    measure_report(&m, "OTG 5 V/2 A", 0);
+    teardown();
+}
+
+// USB PD runs while the BQ registers are being reset, and may already change some of them
+static void test_setters_during_reset(void) {
+    memset(&world, 0, sizeof(world));
+    world.conn = Unattached;
+    memset(&bq, 0, sizeof(bq));
+    bq.charge_mas = 0.5 * CAPACITY_MAS;
+
+    CHECK(bq_init(config.chargingVoltageLimit, config.chargingCurrentLimit, false), "bq_init failed");
+    uint32_t transactions = bq_transactions;
+    CHECK(bq_set_vbus_discharge(true), "bq_set_vbus_discharge failed");
+    CHECK(bq_disable_otg(), "bq_disable_otg failed");
+    CHECK(bq_transactions == transactions, "%lu BQ transactions during the reset",
+          (unsigned long)(bq_transactions - transactions));
+
+    model_advance(BQ_RESET_TICKS);
+    CHECK(bq_init_finish(), "bq_init_finish failed");
+    CHECK(bq.reg[0x16] == 0xCC, "REG16 = %02x after the reset", bq.reg[0x16]);
+    CHECK(!(bq.reg[0x12] & 0x40), "EN_OTG set after the reset");
+
+    CHECK(bq_set_vbus_discharge(false), "bq_set_vbus_discharge failed");
+    CHECK(bq.reg[0x16] == 0xC0, "REG16 = %02x after clearing the pulldowns", bq.reg[0x16]);
+}
+
+static void test_idle(void) {
+    Measurement m;
+    setup(0.8);
+    measure_start(&m);
+    run_for(TICKS_PER_HOUR);
+    CHECK(wakeups - m.wakeups <= 1, "%lu wakeups while idle", (unsigned long)(wakeups - m.wakeups));
+    CHECK(bq_transactions - m.transactions <= 2, "%lu BQ transactions while idle",
+          (unsigned long)(bq_transactions - m.transactions));
+    measure_report(&m, "Idle", 0);
+}
+
+int main(int argc, char **argv) {
+    verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+
+    // First, while the shadow copy is still zeroed as after power-up
+    test_setters_during_reset();
+    test_usb_charging();
+    test_dc_charging_rig_on();
+    test_fault();
+    test_otg_until_low();
+    test_idle();
+
+    if (failures) {
+        printf("test_charger_sm: %d failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("test_charger_sm: OK\n");
+    return EXIT_SUCCESS;
+}
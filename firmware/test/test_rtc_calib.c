@@ -0,0 +1,115 @@
+/*
+ * Host-side check of the RTC frequency correction arithmetic (src/rtc_calib.c): the dithered
+ * RTC.CALIB values must average out to the q8 target, including at the clamp limits, and must
+ * track the crystal's temperature curve more closely than rounding to whole ppm does.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "rtc_calib.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        failures++; \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+    } \
+} while (0)
+
+// Number of intervals per run; the first order sigma-delta error is below 1 ppm-interval
+// at any time, so the average is within 1/STEPS ppm of the target
+#define STEPS 1024
+
+static void test_average_matches_target(void) {
+    for (int32_t target = -130 * 256; target <= 130 * 256; target++) {
+        int32_t clamped = target < -127 * 256 ? -127 * 256 : (target > 127 * 256 ? 127 * 256 : target);
+        uint8_t dither = 0;
+        int32_t sum = 0;
+        for (int i = 0; i < STEPS; i++) {
+            int8_t ppm = rtc_calib_dither(target, &dither);
+            CHECK(ppm != -128, "target %d: %d ppm out of RTC.CALIB range", target, ppm);
+            CHECK(ppm * 256 <= clamped + 255 && ppm * 256 >= clamped - 255,
+                  "target %d: %d ppm is not adjacent", target, ppm);
+            sum += ppm;
+            // The accumulated error stays below 1 ppm-interval
+            int64_t error = (int64_t)sum * 256 - (int64_t)clamped * (i + 1);
+            if (error <= -256 || error >= 256) {
+                CHECK(0, "target %d: error %lld/256 ppm after %d intervals", target, (long long)error, i + 1);
+                break;
+            }
+        }
+    }
+}
+
+static void test_clamp_limits(void) {
+    uint8_t dither = 0;
+    for (int i = 0; i < STEPS; i++) {
+        CHECK(rtc_calib_dither(127 * 256, &dither) == 127, "+127 ppm not applied exactly");
+        CHECK(rtc_calib_dither(200 * 256, &dither) == 127, "+200 ppm not clamped");
+        CHECK(rtc_calib_dither(-127 * 256, &dither) == -127, "-127 ppm not applied exactly");
+        CHECK(rtc_calib_dither(-200 * 256, &dither) == -127, "-200 ppm not clamped");
+    }
+}
+
+// Exact crystal model (ABS06: -0.03 ppm/T^2 around +25 °C)
+static double crystal_offset(double temperature) {
+    double diff = temperature - 25;
+    return -0.03 * diff * diff;
+}
+
+// Simulate a temperature profile with one compensation update per interval (60 s on the device),
+// and compare the drift of the dithered path and of rounding to whole ppm against the exact model
+static void run_profile(const char *name, double (*profile)(int), int intervals) {
+    uint8_t dither = 0;
+    double error_dithered = 0;
+    double error_integer = 0;
+    for (int i = 0; i < intervals; i++) {
+        // The ADC reports whole degrees
+        int16_t temperature = (int16_t)lround(profile(i));
+        double exact = crystal_offset(temperature);
+        int8_t dithered = rtc_calib_dither(rtc_calib_temperature_offset_q8(temperature), &dither);
+        int8_t integer = (int8_t)lround(exact);
+        error_dithered += dithered - exact;
+        error_integer += integer - exact;
+    }
+    // Average drift over the whole profile in ppm
+    error_dithered /= intervals;
+    error_integer /= intervals;
+    printf("%-12s average error: dithered %+.4f ppm, whole ppm %+.4f ppm\n", name, error_dithered, error_integer);
+    // q8 rounding of the temperature curve adds at most 1/256 ppm
+    CHECK(fabs(error_dithered) < 1.0 / 256 + 1.0 / intervals, "%s: dithered error %f ppm", name, error_dithered);
+    CHECK(fabs(error_dithered) <= fabs(error_integer) + 1e-9, "%s: dithering is worse than whole ppm", name);
+}
+
+static double profile_constant(int i) {
+    return 12;
+}
+
+static double profile_daily(int i) {
+    // Between 5 and 35 °C over a day of 1440 intervals
+    return 20 + 15 * sin(2 * M_PI * i / 1440);
+}
+
+static double profile_ramp(int i) {
+    // -20 to +60 °C
+    return -20 + 80.0 * i / 10000;
+}
+
+int main(void) {
+    test_average_matches_target();
+    test_clamp_limits();
+    run_profile("constant", profile_constant, 10000);
+    run_profile("daily", profile_daily, 14400);
+    run_profile("ramp", profile_ramp, 10000);
+
+    if (failures) {
+        printf("test_rtc_calib: %d failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("test_rtc_calib: OK\n");
+    return EXIT_SUCCESS;
+}